@@ -1,45 +1,320 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 
-#define BUFFER_SIZE 4096
+#include "../lib/parse_size.c"
 
-static char buffer[BUFFER_SIZE];
+/* Default size of one buffer. Can be changed at runtime with the
+ * BUFFER_SIZE environment variable (e.g. BUFFER_SIZE=4M). */
+#define BUFFER_SIZE (128 * 1024)
 
-static int out(const char *fn)
+/* Default number of buffers in the ring (BUFFERS=n). */
+#define BUFFERS 4
+
+/* O_DIRECT requires buffers, lengths and file offsets to be aligned
+ * to the logical block size of the file system. 4096 is sufficient
+ * for all devices we care about. */
+#define DIRECT_ALIGN 4096
+
+/* Buffers this large are placed on a 2 MiB boundary and may be backed
+ * by transparent huge pages. */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* How many bytes we ask the kernel to move per zero-copy system
+ * call. As no data passes through user space, this can be much larger
+ * than our buffer. */
+#define CHUNK_SIZE (1 << 30)
+
+/* Upper bound for the number of files we open ahead of time (see
+ * PREFETCH in main()). */
+#define PREFETCH_MAX 64
+
+/* Our buffers form a ring: A reader thread fills buffer i, while the
+ * main thread still writes buffer i-1 to stdout. Thereby, read() and
+ * write() overlap, and neither the input nor the output device idles
+ * while we wait for the other one.
+ *
+ * filled and drained count the buffers that were read and written
+ * for the current file. The reader may run at most `count` buffers
+ * ahead of the writer. */
+struct ring {
+    char    *mem;               // count * size bytes, aligned
+    size_t   size;              // bytes per buffer
+    unsigned count;             // number of buffers
+    ssize_t *len;               // result of read() per buffer
+    int     *err;               // errno of read() per buffer
+
+    int fd;                     // file that is currently copied
+    unsigned filled, drained;
+    bool stop;                  // writer failed, reader should stop
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+};
+
+static struct ring ring = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Should we bypass the page cache with O_DIRECT? (DIRECT=1) */
+static bool direct;
+
+static char *ring_buffer(unsigned i)
+{
+    return ring.mem + (size_t)(i % ring.count) * ring.size;
+}
+
+static int ring_init(size_t size, unsigned count)
 {
-    int fd = open(fn, O_RDONLY);
-    int ret = 0, bytes;
+    // Buffers of at least a huge page start on a huge-page boundary
+    // each, such that every buffer is backed by whole huge pages.
+    size_t align = direct ? DIRECT_ALIGN : 64;
+    if (size >= HUGE_PAGE_SIZE)
+        align = HUGE_PAGE_SIZE;
+    size = (size + align - 1) & ~(align - 1);
 
-    if (fd == -1) {
-        perror("open");
+    // mmap() only guarantees page alignment. Therefore, we map one
+    // alignment unit more than we need and cut off the excess.
+    size_t len = size * count;
+    char *mem = mmap(NULL, len + align, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
         return -1;
     }
 
-    while ((bytes = read(fd, buffer, BUFFER_SIZE)) > 0) {
-        int ret2;
-        char *bp = buffer;
+    ring.mem = (char *)(((unsigned long) mem + align - 1) & ~(align - 1));
+    if (align == HUGE_PAGE_SIZE)
+        madvise(ring.mem, len, MADV_HUGEPAGE);
 
-        while (bytes &&
-               (ret2 = write(STDOUT_FILENO, bp, bytes)) != -1) {
+    ring.size  = size;
+    ring.count = count;
+    ring.len   = calloc(count, sizeof(*ring.len));
+    ring.err   = calloc(count, sizeof(*ring.err));
+    if (!ring.len || !ring.err) {
+        perror("calloc");
+        return -1;
+    }
 
-            bytes -= ret2;
-            bp += ret2;
-            ret += ret2;
-        }
+    return 0;
+}
+
+/* read() that falls back to buffered I/O if the file refuses our
+ * O_DIRECT request. This happens, for example, after a short read in
+ * the middle of a file, which leaves the file offset unaligned. */
+static ssize_t read_direct(int fd, char *buf, size_t count)
+{
+    ssize_t bytes = read(fd, buf, count);
+
+    if (bytes == -1 && errno == EINVAL && direct) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags != -1 && (flags & O_DIRECT) &&
+            fcntl(fd, F_SETFL, flags & ~O_DIRECT) != -1)
+            bytes = read(fd, buf, count);
+        else
+            errno = EINVAL;
+    }
+
+    return bytes;
+}
+
+static void *ring_reader(void *arg)
+{
+    (void) arg;
 
-        if (ret2 == -1) {
+    for (unsigned i = 0; ; i++) {
+        pthread_mutex_lock(&ring.lock);
+        while (i - ring.drained >= ring.count && !ring.stop)
+            pthread_cond_wait(&ring.cond, &ring.lock);
+        bool stop = ring.stop;
+        pthread_mutex_unlock(&ring.lock);
+
+        if (stop)
+            break;
+
+        // The buffer belongs to us now; no lock is held during read()
+        ssize_t bytes = read_direct(ring.fd, ring_buffer(i), ring.size);
+
+        pthread_mutex_lock(&ring.lock);
+        ring.len[i % ring.count] = bytes;
+        ring.err[i % ring.count] = errno;
+        ring.filled = i + 1;
+        pthread_cond_broadcast(&ring.cond);
+        pthread_mutex_unlock(&ring.lock);
+
+        if (bytes <= 0)
+            break;
+    }
+
+    return NULL;
+}
+
+static int write_all(const char *bp, ssize_t bytes)
+{
+    while (bytes) {
+        ssize_t ret = write(STDOUT_FILENO, bp, bytes);
+        if (ret == -1) {
             perror("write");
+            return -1;
+        }
+        bytes -= ret;
+        bp += ret;
+    }
+
+    return 0;
+}
+
+/* Copy fd to stdout through the ring, with the reader thread running
+ * ahead of us. */
+static int out_ring(int fd)
+{
+    pthread_t reader;
+    int ret = 0, err;
+
+    ring.fd = fd;
+    ring.filled = ring.drained = 0;
+    ring.stop = false;
+
+    if ((err = pthread_create(&reader, NULL, ring_reader, NULL))) {
+        errno = err;
+        perror("pthread_create");
+        return -1;
+    }
+
+    for (unsigned i = 0; ; i++) {
+        pthread_mutex_lock(&ring.lock);
+        while (ring.filled <= i)
+            pthread_cond_wait(&ring.cond, &ring.lock);
+        ssize_t bytes = ring.len[i % ring.count];
+        errno = ring.err[i % ring.count];
+        pthread_mutex_unlock(&ring.lock);
+
+        if (bytes == -1) {
+            perror("read");
             ret = -1;
-            goto out_close;
         }
+        if (bytes <= 0)
+            break;
+
+        if (write_all(ring_buffer(i), bytes) == -1) {
+            ret = -1;
+            pthread_mutex_lock(&ring.lock);
+            ring.stop = true;
+            pthread_cond_broadcast(&ring.cond);
+            pthread_mutex_unlock(&ring.lock);
+            break;
+        }
+
+        pthread_mutex_lock(&ring.lock);
+        ring.drained = i + 1;
+        pthread_cond_broadcast(&ring.cond);
+        pthread_mutex_unlock(&ring.lock);
+    }
+
+    pthread_join(reader, NULL);
+    return ret;
+}
+
+/* Copy fd to stdout with a plain read/write loop on the first buffer. */
+static int out_simple(int fd)
+{
+    ssize_t bytes;
+
+    while ((bytes = read_direct(fd, ring.mem, ring.size)) > 0) {
+        if (write_all(ring.mem, bytes) == -1)
+            return -1;
     }
 
     if (bytes == -1) {
         perror("read");
-        ret = -1;
+        return -1;
     }
 
+    return 0;
+}
+
+/* If the input is a regular file, the kernel can move the data to
+ * stdout without copying it through our buffer. Which system call we
+ * can use depends on the type of stdout:
+ *
+ *   - regular file: copy_file_range (may even share the blocks)
+ *   - pipe:         splice
+ *   - socket:       sendfile
+ *
+ * All three advance the file offset of fd, like read() does. Returns
+ * the number of copied bytes, or -1 with errno set. If the kernel
+ * does not support the combination (EINVAL, EXDEV, ...) the caller
+ * can simply continue with read/write from the current offset. */
+static ssize_t out_zerocopy(int fd, mode_t mode)
+{
+    ssize_t ret = 0, bytes;
+
+    do {
+        if (S_ISREG(mode))
+            bytes = copy_file_range(fd, NULL, STDOUT_FILENO, NULL, CHUNK_SIZE, 0);
+        else if (S_ISFIFO(mode))
+            bytes = splice(fd, NULL, STDOUT_FILENO, NULL, CHUNK_SIZE, SPLICE_F_MORE);
+        else if (S_ISSOCK(mode))
+            bytes = sendfile(STDOUT_FILENO, fd, NULL, CHUNK_SIZE);
+        else
+            bytes = (errno = EINVAL, -1);
+
+        if (bytes > 0)
+            ret += bytes;
+    } while (bytes > 0);
+
+    return bytes == -1 ? -1 : ret;
+}
+
+/* Errors from the zero-copy path that only say "not for this pair of
+ * files". After these, we fall back to the read/write loop. */
+static int zerocopy_unsupported(int err)
+{
+    return err == EINVAL || err == EXDEV || err == ENOSYS ||
+        err == EOPNOTSUPP || err == EBADF;
+}
+
+static int out(int fd)
+{
+    int ret = 0;
+    struct stat in, stdout_stat;
+    bool have_stat = fstat(fd, &in) == 0;
+
+    /* Files in /proc and /sys report a size of zero, but still have
+     * content. Those only work with read(). Terminals are neither
+     * regular files, pipes nor sockets, so they end up in the read/write
+     * loop as well. The zero-copy path goes through the page cache,
+     * which is exactly what O_DIRECT wants to avoid. */
+    if (!direct && have_stat && S_ISREG(in.st_mode) && in.st_size > 0 &&
+        fstat(STDOUT_FILENO, &stdout_stat) == 0) {
+        if (out_zerocopy(fd, stdout_stat.st_mode) != -1)
+            goto out_close;
+
+        if (!zerocopy_unsupported(errno)) {
+            perror("out_zerocopy");
+            ret = -1;
+            goto out_close;
+        }
+    }
+
+    /* For files that fit into a single buffer, a reader thread would
+     * cost more than it could ever overlap. */
+    if (ring.count > 1 &&
+        !(have_stat && S_ISREG(in.st_mode) && in.st_size > 0 &&
+          (size_t) in.st_size <= ring.size))
+        ret = out_ring(fd);
+    else
+        ret = out_simple(fd);
+
 out_close:
     if (close(fd) == -1)
         perror("close");
@@ -47,12 +322,98 @@ out_close:
     return ret;
 }
 
+/* A file that was opened ahead of time. If open() failed, we remember
+ * errno and report it once it is this file's turn. Thereby, the output
+ * (and the error messages) stay exactly the same as without read-ahead. */
+struct pending {
+    int fd;
+    int err;
+};
+
+static void prefetch(const char *fn, struct pending *p)
+{
+    p->fd = open(fn, O_RDONLY);
+    p->err = errno;
+    if (p->fd == -1)
+        return;
+
+    /* In direct mode, we do not want the file in the page cache at
+     * all. Not every file system supports O_DIRECT (e.g., tmpfs); for
+     * those, we silently stay with buffered I/O. */
+    if (direct) {
+        int flags = fcntl(p->fd, F_GETFL);
+        if (flags != -1)
+            fcntl(p->fd, F_SETFL, flags | O_DIRECT);
+        return;
+    }
+
+    /* Ask the kernel to start reading the whole file into the page
+     * cache. This returns immediately; the I/O runs in the background
+     * while we are still busy writing the previous files. */
+    posix_fadvise(p->fd, 0, 0, POSIX_FADV_WILLNEED);
+}
+
 int main(int argc, char *argv[])
 {
+    // The buffer ring is configured by environment variables:
+    //   BUFFER_SIZE: bytes per buffer (default 128K)
+    //   BUFFERS:     number of buffers; 1 disables the reader thread
+    //   DIRECT:      if set to 1, read the files with O_DIRECT
+    char *SIZE = getenv("BUFFER_SIZE");
+    char *COUNT = getenv("BUFFERS");
+    char *DIRECT = getenv("DIRECT");
+
+    size_t size = BUFFER_SIZE;
+    if (SIZE && parse_size(SIZE, NULL, &size) == -1)
+        size = 0;
+    int count = COUNT ? atoi(COUNT) : BUFFERS;
+    direct = DIRECT && atoi(DIRECT);
+
+    if (size == 0 || count < 1) {
+        fprintf(stderr, "%s: invalid BUFFER_SIZE or BUFFERS\n", argv[0]);
+        return 1;
+    }
+
+    if (ring_init(size, count) == -1)
+        return 1;
+
+    // While we write file i, the files i+1..i+PREFETCH are already
+    // open and their contents are on their way into the page cache.
+    // With PREFETCH=0, we open each file just before we need it.
+    char *PREFETCH = getenv("PREFETCH");
+    int depth = atoi(PREFETCH ? PREFETCH : "8");
+    if (depth < 0)
+        depth = 0;
+    if (depth > PREFETCH_MAX)
+        depth = PREFETCH_MAX;
+
+    struct pending window[PREFETCH_MAX + 1];
+    int opened = 1;             // argv[1..opened) are in the window
+
     for (int i = 1; i < argc; i++)
     {
-        if (out(argv[i]) == -1)
+        for (; opened < argc && opened <= i + depth; opened++)
+            prefetch(argv[opened], &window[opened % (depth + 1)]);
+
+        struct pending *p = &window[i % (depth + 1)];
+        int ret;
+
+        if (p->fd == -1) {
+            errno = p->err;
+            perror("open");
+            ret = -1;
+        } else {
+            ret = out(p->fd);
+        }
+
+        if (ret == -1) {
+            // Do not leak the files we have opened in advance.
+            for (int j = i + 1; j < opened; j++) {
+                if (window[j % (depth + 1)].fd != -1)
+                    close(window[j % (depth + 1)].fd);
+            }
             return 1;
+        }
     }
 
     return 0;
@@ -0,0 +1,252 @@
+/* Task-creation benchmark: How long does it take to create a new task
+ * and to wait for its termination?
+ *
+ * We create and join ITERATIONS (default: 1000) tasks per mechanism
+ * and report a latency histogram. As fork() has to copy the page
+ * tables of the parent, its cost grows with the parent's resident set
+ * size. Therefore, we repeat all measurements for each size in the
+ * RSS environment variable (default: 0,512M), for which the parent
+ * allocates and touches anonymous memory.
+ *
+ * Mechanisms:
+ *   fork        -- fork(), the child exits immediately
+ *   vfork       -- vfork(), the parent sleeps until the child exits
+ *   clone-vm    -- clone(CLONE_VM | CLONE_VFORK), what posix_spawn uses
+ *   chimera     -- clone(CLONE_VM), the "chimera" mode from above
+ *   clone3      -- clone3() with fork semantics
+ *   posix_spawn -- posix_spawn() of this program, which exits at once
+ *   pthread     -- pthread_create() and pthread_join()
+ *   pool        -- pool_submit() and pool_join() on an idle pool worker
+ */
+#include <linux/sched.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define BENCH_STACK_SIZE (64 * 1024)
+
+// Child stack for the clone()-based mechanisms. The stack grows
+// downwards, and the ABI requires its top to be 16-byte aligned.
+static char *bench_stack_top;
+
+extern char **environ;
+
+static int nop_entry(void *arg) {
+    (void) arg;
+    return 0;
+}
+
+static void *nop_thread(void *arg) {
+    return arg;
+}
+
+static void join(pid_t pid) {
+    if (pid < 0) {
+        perror("create");
+        exit(1);
+    }
+    if (waitpid(pid, NULL, __WALL) < 0) {
+        perror("waitpid");
+        exit(1);
+    }
+}
+
+static void bench_fork(void) {
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(0);
+    join(pid);
+}
+
+static void bench_vfork(void) {
+    pid_t pid = vfork();
+    if (pid == 0)
+        _exit(0);
+    join(pid);
+}
+
+static void bench_clone_vm(void) {
+    join(clone(nop_entry, bench_stack_top, CLONE_VM | CLONE_VFORK | SIGCHLD, NULL));
+}
+
+static void bench_chimera(void) {
+    join(clone(nop_entry, bench_stack_top, CLONE_VM | SIGCHLD, NULL));
+}
+
+static void bench_clone3(void) {
+    struct clone_args args = {
+        .exit_signal = SIGCHLD,
+    };
+    pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (pid == 0)
+        _exit(0);
+    join(pid);
+}
+
+static void bench_posix_spawn(void) {
+    char *argv[] = { "clone", "nop", NULL };
+    pid_t pid;
+    int err = posix_spawn(&pid, "/proc/self/exe", NULL, NULL, argv, environ);
+    if (err) {
+        errno = err;
+        perror("posix_spawn");
+        exit(1);
+    }
+    join(pid);
+}
+
+static void bench_pthread(void) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, nop_thread, NULL);
+    if (err) {
+        errno = err;
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_join(thread, NULL);
+}
+
+static struct pool bench_pool_workers;
+
+static void bench_pool(void) {
+    struct task t;
+    if (pool_submit(&bench_pool_workers, &t, nop_entry, NULL) < 0) {
+        perror("pool_submit");
+        exit(1);
+    }
+    pool_join(&t);
+}
+
+struct {
+    char *name;
+    void (*run)(void);
+} bench_modes[] = {
+    { "fork",        bench_fork },
+    { "vfork",       bench_vfork },
+    { "clone-vm",    bench_clone_vm },
+    { "chimera",     bench_chimera },
+    { "clone3",      bench_clone3 },
+    { "posix_spawn", bench_posix_spawn },
+    { "pthread",     bench_pthread },
+    { "pool",        bench_pool },
+};
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+// Parse the next size of a comma-separated list like "0,512M". On
+// success, *end points behind the separating comma (or to the
+// terminating NUL). Returns -1, if s does not start with such a size.
+static int bench_next_size(const char *s, char **end, size_t *size) {
+    if (parse_size(s, end, size) < 0)
+        return -1;
+
+    if (**end == ',')
+        (*end)++;
+    else if (**end != '\0')
+        return -1;
+    return 0;
+}
+
+// Print percentiles and a histogram with power-of-two buckets
+static void bench_report(char *name, long long *lat, int n) {
+    qsort(lat, n, sizeof(*lat), compare_ll);
+    printf("%-12s min %7.1f  p50 %7.1f  p90 %7.1f  p99 %7.1f  max %7.1f us\n",
+           name, lat[0] / 1e3, lat[n / 2] / 1e3, lat[n * 9 / 10] / 1e3,
+           lat[n * 99 / 100] / 1e3, lat[n - 1] / 1e3);
+
+    int buckets[64] = { 0 };
+    for (int i = 0; i < n; i++)
+        buckets[63 - __builtin_clzll(lat[i] | 1)]++;
+
+    for (int b = 0; b < 64; b++) {
+        if (!buckets[b])
+            continue;
+        printf("    [%8.1f, %8.1f) us %6d ", (1LL << b) / 1e3, (2LL << b) / 1e3,
+               buckets[b]);
+        for (int i = 0; i < buckets[b] * 50 / n; i++)
+            putchar('#');
+        putchar('\n');
+    }
+}
+
+int bench(void) {
+    char *ITERATIONS = getenv("ITERATIONS");
+    int iterations = atoi(ITERATIONS ? ITERATIONS : "1000");
+    if (iterations < 1)
+        iterations = 1;
+
+    char *RSS = getenv("RSS");
+    if (!RSS)
+        RSS = "0,512M";
+    for (char *p = RSS; *p; ) {
+        size_t rss;
+        if (bench_next_size(p, &p, &rss) < 0) {
+            fprintf(stderr, "RSS: invalid size list: %s\n", RSS);
+            return -1;
+        }
+    }
+
+    char *stack = mmap(NULL, BENCH_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    bench_stack_top = stack + BENCH_STACK_SIZE;
+
+    if (pool_init(&bench_pool_workers, 1) < 0) {
+        perror("pool_init");
+        return -1;
+    }
+
+    long long *lat = malloc(iterations * sizeof(*lat));
+    if (!lat) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (char *p = RSS; *p; ) {
+        size_t rss;
+        bench_next_size(p, &p, &rss);   // checked above
+
+        // Grow our resident set: MAP_POPULATE faults in all pages,
+        // such that fork() has to copy all their page-table entries.
+        char *ballast = NULL;
+        if (rss > 0) {
+            ballast = mmap(NULL, rss, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+            if (ballast == MAP_FAILED) {
+                perror("mmap");
+                return -1;
+            }
+        }
+
+        printf("==== parent RSS +%zu MiB, %d iterations\n", rss >> 20, iterations);
+        for (size_t m = 0; m < ARRAY_SIZE(bench_modes); m++) {
+            for (int i = 0; i < iterations; i++) {
+                long long start = now_ns();
+                bench_modes[m].run();
+                lat[i] = now_ns() - start;
+            }
+            bench_report(bench_modes[m].name, lat, iterations);
+        }
+
+        if (ballast)
+            munmap(ballast, rss);
+    }
+
+    free(lat);
+    pool_destroy(&bench_pool_workers);
+    munmap(stack, BENCH_STACK_SIZE);
+    return 0;
+}
@@ -22,40 +22,31 @@
  * fiddle around with threading. However, this leads to a problem with
  * the libc, which must perform some user-space operations to setup a
  * new thread. For example, in a clone()ed thread, we cannot simply
- * use printf(). Therefore, we provide you with a simple function to
- * output a string and a number. The writing to stdout (fd=1) is done
- * with plain system calls.
+ * use printf(). Therefore, we provide you with syscall_printf(), which
+ * formats on the stack and writes with a single writev() system call
+ * (see lib/syscall_printf.c), and a shorthand to output a string and a
+ * number on stdout (fd=1).
  *
  * Example: syscall_write("foobar = ", 23);
  */
+#include "../lib/syscall_printf.c"
+#include "../lib/parse_size.c"
+
 int syscall_write(char *msg, int number) {
-    write(1, msg, strlen(msg));
-    if (number != 0) {
-        char buffer[sizeof(number) * 3];
-        char *p = &buffer[sizeof(number) * 3];
-        int len = 1;
-        *(--p) = '\n';
-        if (number < 0) {
-            write(1, "-", 1);
-            number *= -1;
-        }
-        while (number > 0) {
-            ;            *(--p) =  (number % 10) + '0';
-            number /= 10;
-            len ++;
-        }
-        write(1, p, len);
-    } else {
-        write(1, "0\n", 2);
-    }
+    return syscall_printf(1, "%s%d\n", msg, number);
+}
 
+#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(*(arr)))
 
-    return 0;
-}
+#include "pool.c"
+#include "bench.c"
+#include "zygote.c"
 
 // For the new task, we always require an stack area. To make our life
 // easier, we just statically allocate an global variable of PAGE_SIZE.
-char stack[4096];
+// The stack grows downwards, so we pass its end to clone(). The ABI
+// requires the stack pointer to be 16-byte aligned.
+char stack[4096] __attribute__((aligned(16)));
 
 // To demonstrate whether child and parent are within the same
 // namespace, we count up a global variable. If they are within the
@@ -65,7 +56,7 @@ volatile int counter = 0;
 
 int child_entry(void* arg) {
     // We just give a little bit of information to the user. 
-    syscall_write(": Hello from child_entry", 0);
+    syscall_printf(1, ": Hello from child_entry\n");
     syscall_write(": getppid() = ", getppid()); // What is our parent PID
     syscall_write(": getpid()  = ", getpid());  // What is our thread group/process id
     syscall_write(": gettid()  = ", gettid());  // The ID of this thread!
@@ -104,8 +95,53 @@ int child_entry(void* arg) {
     return 0;
 }
 
+// A task for the worker pool. Each task reports on which worker
+// thread it runs. With more tasks than workers, the thread IDs repeat.
+int pool_task(void *arg) {
+    syscall_write(": task = ", (intptr_t) arg);
+    syscall_write(":   gettid() = ", raw_syscall(SYS_gettid, 0, 0, 0, 0, 0, 0));
+    return (intptr_t) arg * 2;
+}
+
+int pool_demo(void) {
+    struct pool pool;
+    struct task tasks[8];
+
+    if (pool_init(&pool, 3) < 0) {
+        perror("pool_init");
+        return -1;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(tasks); i++) {
+        if (pool_submit(&pool, &tasks[i], pool_task, (void *) i) < 0) {
+            perror("pool_submit");
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(tasks); i++)
+        syscall_write("> pool_join() = ", pool_join(&tasks[i]));
+
+    syscall_write("> workers = ", pool.nworkers);
+    pool_destroy(&pool);
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
+    // The posix_spawn benchmark starts us with this mode. We do
+    // nothing but exit.
+    if (argc == 2 && !strcmp(argv[1], "nop"))
+        return 0;
+
+    if (argc == 2 && !strcmp(argv[1], "bench"))
+        return bench();
+
+    if (argc == 2 && !strcmp(argv[1], "pool"))
+        return pool_demo();
+
+    if (argc == 2 && !strcmp(argv[1], "zygote"))
+        return zygote_demo();
+
     if (argc != 2) {
         printf("usage: %s MODE\n", argv[0]);
         printf("MODE:\n");
@@ -113,10 +149,13 @@ int main(int argc, char *argv[]) {
         printf("  - chimera -- create process/thread chimera\n");
         printf("  - thread  -- create a new thread in a process\n");
         printf("  - user    -- create a new process and alter its UID namespace\n");
+        printf("  - pool    -- run tasks on a pool of raw clone() workers\n");
+        printf("  - zygote  -- run commands from stdin in a pre-forked namespace sandbox\n");
+        printf("  - bench   -- measure task creation latency (env: ITERATIONS, RSS)\n");
         return -1;
     }
 
-    syscall_write("> Hello from main!", 0);
+    syscall_printf(1, "> Hello from main!\n");
     syscall_write("> getppid() = ", getppid());
     syscall_write("> getpid()  = ", getpid());
     syscall_write("> gettid()  = ", gettid());
@@ -140,12 +179,12 @@ int main(int argc, char *argv[]) {
         printf("Invalid clone() mode: %s\n", argv[1]);
         return -1;
     }
-    int ret = clone(child_entry, stack+sizeof(stack)-1, flags, arg);
+    int ret = clone(child_entry, stack+sizeof(stack), flags, arg);
     syscall_write("> clone() = ", ret);
     if (arg)
         free(arg);
 
-    syscall_write("\n!!!!! Press C-c to terminate. !!!!!", 0);
+    syscall_printf(1, "\n!!!!! Press C-c to terminate. !!!!!\n");
     while (counter < 4) {
         syscall_write("counter = ", counter);
         sleep(1);
@@ -0,0 +1,210 @@
+/* A small task runtime on top of raw clone().
+ *
+ * Each worker is a thread that we create with clone() ourselves,
+ * without the help of libpthread. It runs on its own mmap()ed stack,
+ * whose lowest page is a PROT_NONE guard page: A stack overflow
+ * results in a SIGSEGV instead of silently overwriting other memory.
+ *
+ * For the synchronization, we only use futexes:
+ *
+ *   - worker->state: An idle worker sleeps on this word until we hand
+ *     it a task (BUSY) or ask it to terminate (EXIT).
+ *   - task->done:    pool_join() sleeps on this word until the worker
+ *     has finished the task.
+ *   - worker->tid:   With CLONE_CHILD_CLEARTID, the kernel clears this
+ *     word and wakes its futex waiters when the thread has exited. Only
+ *     then, we may unmap the worker's stack.
+ *
+ * After a task, the worker becomes idle and is reused for later tasks.
+ * Thereby, we pay the clone() cost only once per worker.
+ *
+ * As our workers have no thread-local storage of their own (we do not
+ * pass CLONE_SETTLS), tasks must not use libc functions that depend on
+ * it (printf, malloc, ...), and must not touch errno, which belongs to
+ * the thread that created the pool. syscall_printf() and raw_syscall()
+ * (see lib/) are safe; the runtime itself only uses raw_syscall().
+ */
+#include <stdatomic.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+
+#include "../lib/raw_syscall.c"
+
+#ifndef HAVE_RAW_SYSCALL
+#error "pool.c needs raw_syscall(), which is only implemented for x86-64"
+#endif
+
+#define POOL_STACK_SIZE (64 * 1024)
+#define POOL_GUARD_SIZE 4096
+
+// Returns errors as -errno, see above
+static long pool_futex(atomic_int *addr, int op, int val) {
+    return raw_syscall(SYS_futex, (long) addr, op, val, 0, 0, 0);
+}
+
+struct task {
+    int (*fn)(void *);
+    void *arg;
+    int result;
+    atomic_int done;            // 0: pending, 1: done
+};
+
+enum { WORKER_IDLE, WORKER_CLAIMED, WORKER_BUSY, WORKER_EXIT };
+
+struct worker {
+    struct pool *pool;
+    char *stack;                // lowest address of the mapping
+    atomic_int tid;             // cleared by the kernel on exit
+    atomic_int state;
+    struct task *task;
+};
+
+struct pool {
+    struct worker *workers;
+    int nworkers, max_workers;
+
+    // Incremented whenever a worker becomes idle. pool_submit() sleeps
+    // on it if all workers are busy.
+    atomic_int idle_seq;
+    atomic_int waiters;
+};
+
+static int pool_worker_entry(void *arg) {
+    struct worker *w = arg;
+
+    for (;;) {
+        int state;
+        while ((state = atomic_load(&w->state)) != WORKER_BUSY &&
+               state != WORKER_EXIT)
+            pool_futex(&w->state, FUTEX_WAIT, state);
+
+        if (state == WORKER_EXIT)
+            return 0;           // clone() terminates the thread for us
+
+        struct task *t = w->task;
+        t->result = t->fn(t->arg);
+
+        // First, we make us available again. Only then, we signal
+        // the completion. Otherwise, a task that waits for its
+        // predecessor could find all workers busy.
+        atomic_store(&w->state, WORKER_IDLE);
+        atomic_fetch_add(&w->pool->idle_seq, 1);
+        if (atomic_load(&w->pool->waiters))
+            pool_futex(&w->pool->idle_seq, FUTEX_WAKE, 1);
+
+        atomic_store(&t->done, 1);
+        pool_futex(&t->done, FUTEX_WAKE, INT_MAX);
+    }
+}
+
+int pool_init(struct pool *p, int max_workers) {
+    p->workers = calloc(max_workers, sizeof(*p->workers));
+    if (!p->workers)
+        return -1;
+
+    p->nworkers = 0;
+    p->max_workers = max_workers;
+    atomic_init(&p->idle_seq, 0);
+    atomic_init(&p->waiters, 0);
+    return 0;
+}
+
+// Create a new worker that immediately runs the given task
+static int pool_spawn(struct pool *p, struct task *t) {
+    struct worker *w = &p->workers[p->nworkers];
+
+    w->stack = mmap(NULL, POOL_STACK_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (w->stack == MAP_FAILED)
+        return -1;
+    if (mprotect(w->stack, POOL_GUARD_SIZE, PROT_NONE) < 0) {
+        munmap(w->stack, POOL_STACK_SIZE);
+        return -1;
+    }
+
+    w->pool = p;
+    w->task = t;
+    atomic_init(&w->state, WORKER_BUSY);
+
+    // The stack grows downwards from its highest address. The end of
+    // the mapping is page aligned and thus satisfies the 16-byte
+    // alignment that the ABI requires.
+    int flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND |
+        CLONE_THREAD | CLONE_SYSVSEM |
+        CLONE_PARENT_SETTID | CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID;
+    int tid = clone(pool_worker_entry, w->stack + POOL_STACK_SIZE, flags, w,
+                    &w->tid, NULL, &w->tid);
+    if (tid == -1) {
+        munmap(w->stack, POOL_STACK_SIZE);
+        return -1;
+    }
+
+    p->nworkers++;
+    return 0;
+}
+
+// Run fn(arg) on an idle worker. If all workers are busy, we create a
+// new one, or, if there are already max_workers, wait for one to
+// become idle. pool_submit() must only be called from one thread.
+int pool_submit(struct pool *p, struct task *t, int (*fn)(void *), void *arg) {
+    t->fn = fn;
+    t->arg = arg;
+    atomic_init(&t->done, 0);
+
+    for (;;) {
+        int seq = atomic_load(&p->idle_seq);
+
+        for (int i = 0; i < p->nworkers; i++) {
+            struct worker *w = &p->workers[i];
+            int idle = WORKER_IDLE;
+
+            // We claim the worker before we hand over the task. The
+            // worker keeps sleeping until the state becomes BUSY.
+            if (!atomic_compare_exchange_strong(&w->state, &idle, WORKER_CLAIMED))
+                continue;
+
+            w->task = t;
+            atomic_store(&w->state, WORKER_BUSY);
+            pool_futex(&w->state, FUTEX_WAKE, 1);
+            return 0;
+        }
+
+        if (p->nworkers < p->max_workers)
+            return pool_spawn(p, t);
+
+        atomic_fetch_add(&p->waiters, 1);
+        pool_futex(&p->idle_seq, FUTEX_WAIT, seq);
+        atomic_fetch_sub(&p->waiters, 1);
+    }
+}
+
+// Wait for the task to finish and return the result of its function.
+int pool_join(struct task *t) {
+    while (!atomic_load(&t->done))
+        pool_futex(&t->done, FUTEX_WAIT, 0);
+
+    return t->result;
+}
+
+// Terminate all workers and release their stacks. All submitted tasks
+// must have been joined.
+void pool_destroy(struct pool *p) {
+    for (int i = 0; i < p->nworkers; i++) {
+        struct worker *w = &p->workers[i];
+        atomic_store(&w->state, WORKER_EXIT);
+        pool_futex(&w->state, FUTEX_WAKE, 1);
+    }
+
+    for (int i = 0; i < p->nworkers; i++) {
+        struct worker *w = &p->workers[i];
+        int tid;
+        while ((tid = atomic_load(&w->tid)) != 0)
+            pool_futex(&w->tid, FUTEX_WAIT, tid);
+
+        munmap(w->stack, POOL_STACK_SIZE);
+    }
+
+    free(p->workers);
+    p->nworkers = 0;
+}
@@ -0,0 +1,310 @@
+/* A zygote-based sandbox launcher.
+ *
+ * Setting up namespaces (user, mount, PID) for every job is expensive:
+ * the kernel has to create the namespaces, we have to write the ID
+ * maps, and we have to remount /proc. Instead, we pay this cost once:
+ * We clone() a "zygote" process into fresh namespaces, which then
+ * fork()s the sandboxed workers on request. A fork() within the
+ * namespaces is as cheap as a regular fork().
+ *
+ * The zygote and the launcher talk over a unix-domain SOCK_SEQPACKET
+ * socket, which preserves message boundaries:
+ *
+ *   launcher -> zygote: struct zygote_request  (run this command)
+ *   zygote -> launcher: struct zygote_response (STARTED, then EXITED)
+ *
+ * Once the namespaces are set up, the zygote reports READY (or FAILED,
+ * if it could not set them up), and zygote_start() waits for that.
+ *
+ * As the zygote is PID 1 of its PID namespace, it also has to reap
+ * the workers. It waits for requests and for SIGCHLD with poll() on the
+ * socket and a signalfd. If the launcher closes the socket, the zygote
+ * exits, and the kernel kills all remaining workers in the namespace.
+ */
+#include <poll.h>
+#include <signal.h>
+#include <sys/mount.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define ZYGOTE_STACK_SIZE (64 * 1024)
+
+struct zygote_request {
+    uint32_t id;
+    char cmd[256];
+};
+
+enum { ZYGOTE_STARTED, ZYGOTE_EXITED, ZYGOTE_FAILED, ZYGOTE_READY };
+
+struct zygote_response {
+    uint32_t id;
+    int event;
+    pid_t pid;                  // within the zygote's PID namespace
+    int status;                 // for EXITED: wait status, for FAILED: errno
+};
+
+struct zygote {
+    pid_t pid;                  // in our PID namespace
+    int sock;
+};
+
+// Write a string to a file, as needed for /proc/self/{uid_map,gid_map,setgroups}
+static int write_file(const char *fn, const char *s) {
+    int fd = open(fn, O_WRONLY);
+    if (fd < 0)
+        return -1;
+
+    ssize_t len = strlen(s), ret = write(fd, s, len);
+    close(fd);
+    return ret == len ? 0 : -1;
+}
+
+struct zygote_setup {
+    int sock;                   // our end of the connection
+    int launcher_sock;          // the launcher's end, inherited by clone()
+    uid_t uid;
+    gid_t gid;
+};
+
+// Report a failed setup step to the launcher, and give up
+static int zygote_setup_failed(int sock, const char *what) {
+    struct zygote_response resp = { .event = ZYGOTE_FAILED, .status = errno };
+    perror(what);
+    send(sock, &resp, sizeof(resp), 0);
+    return 1;
+}
+
+// Runs in the new namespaces. Sets them up once and then serves
+// requests until the launcher hangs up.
+static int zygote_entry(void *arg) {
+    struct zygote_setup *setup = arg;
+    int sock = setup->sock;
+    char map[64];
+
+    // We got a copy of the launcher's file descriptors. If we kept its
+    // end of the socket open, we would never notice when it hangs up.
+    close(setup->launcher_sock);
+
+    // Map our old user/group to root within the user namespace. Before
+    // an unprivileged process may write gid_map, it has to give up the
+    // ability to call setgroups().
+    snprintf(map, sizeof(map), "0 %d 1\n", setup->uid);
+    if (write_file("/proc/self/uid_map", map) < 0)
+        return zygote_setup_failed(sock, "zygote: uid_map");
+    if (write_file("/proc/self/setgroups", "deny") < 0)
+        return zygote_setup_failed(sock, "zygote: setgroups");
+    snprintf(map, sizeof(map), "0 %d 1\n", setup->gid);
+    if (write_file("/proc/self/gid_map", map) < 0)
+        return zygote_setup_failed(sock, "zygote: gid_map");
+
+    // Keep our mounts from propagating back to the parent namespace,
+    // and mount a /proc that shows only the processes of our PID
+    // namespace. Without them, the workers would see the host's
+    // processes; thus, we do not run without them.
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0)
+        return zygote_setup_failed(sock, "zygote: mount /");
+    if (mount("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL) < 0)
+        return zygote_setup_failed(sock, "zygote: mount /proc");
+
+    // We handle SIGCHLD synchronously with a signalfd
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sfd < 0)
+        return zygote_setup_failed(sock, "zygote: signalfd");
+
+    struct zygote_response ready = { .event = ZYGOTE_READY };
+    send(sock, &ready, sizeof(ready), 0);
+
+    // Which request belongs to which worker? We only have to remember
+    // the running ones.
+    struct { pid_t pid; uint32_t id; } jobs[64];
+    int njobs = 0;
+
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = sock, .events = POLLIN },
+            { .fd = sfd,  .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("zygote: poll");
+            return 1;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo si;
+            if (read(sfd, &si, sizeof(si)) < 0)
+                perror("zygote: read");
+
+            // Signals coalesce: reap all workers that have exited.
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (int i = 0; i < njobs; i++) {
+                    if (jobs[i].pid != pid)
+                        continue;
+                    struct zygote_response resp = {
+                        .id = jobs[i].id, .event = ZYGOTE_EXITED,
+                        .pid = pid, .status = status,
+                    };
+                    send(sock, &resp, sizeof(resp), 0);
+                    jobs[i] = jobs[--njobs];
+                    break;
+                }
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            struct zygote_request req;
+            ssize_t n = recv(sock, &req, sizeof(req), 0);
+            if (n <= 0)
+                return 0;       // launcher has gone away
+            req.cmd[sizeof(req.cmd) - 1] = '\0';
+
+            struct zygote_response resp = { .id = req.id };
+            pid_t pid = njobs < (int) ARRAY_SIZE(jobs) ? fork() : (errno = EAGAIN, -1);
+            if (pid == 0) {
+                // Worker: restore the signal mask and run the job
+                sigprocmask(SIG_UNBLOCK, &mask, NULL);
+                close(sock);
+                close(sfd);
+                execl("/bin/sh", "sh", "-c", req.cmd, (char *) NULL);
+                _exit(127);
+            }
+
+            if (pid < 0) {
+                resp.event  = ZYGOTE_FAILED;
+                resp.status = errno;
+            } else {
+                resp.event = ZYGOTE_STARTED;
+                resp.pid   = pid;
+                jobs[njobs].pid = pid;
+                jobs[njobs].id  = req.id;
+                njobs++;
+            }
+            send(sock, &resp, sizeof(resp), 0);
+        }
+    }
+}
+
+// Create the zygote in new user, mount, and PID namespaces, and wait
+// until it has set them up.
+int zygote_start(struct zygote *z) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+
+    // Without CLONE_VM, the zygote gets a copy of our address space
+    // (like with fork()). Therefore, we can free the stack right away.
+    char *stack = mmap(NULL, ZYGOTE_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+        return -1;
+
+    struct zygote_setup setup = {
+        .sock = sv[1], .launcher_sock = sv[0],
+        .uid = getuid(), .gid = getgid(),
+    };
+    z->pid = clone(zygote_entry, stack + ZYGOTE_STACK_SIZE,
+                   CLONE_NEWUSER | CLONE_NEWNS | CLONE_NEWPID | SIGCHLD, &setup);
+    int err = errno;
+    munmap(stack, ZYGOTE_STACK_SIZE);
+    close(sv[1]);
+
+    if (z->pid < 0) {
+        close(sv[0]);
+        errno = err;
+        return -1;
+    }
+
+    z->sock = sv[0];
+
+    // The zygote reports READY or FAILED. If it dies before, the
+    // socket reports end-of-file.
+    struct zygote_response resp;
+    ssize_t n = recv(z->sock, &resp, sizeof(resp), 0);
+    if (n == sizeof(resp) && resp.event == ZYGOTE_READY)
+        return 0;
+
+    err = n < 0 ? errno : n == sizeof(resp) && resp.event == ZYGOTE_FAILED ? resp.status : EPROTO;
+    close(z->sock);
+    waitpid(z->pid, NULL, 0);
+    errno = err;
+    return -1;
+}
+
+// Ask the zygote to run cmd with /bin/sh in a new sandboxed worker.
+int zygote_run(struct zygote *z, uint32_t id, const char *cmd) {
+    struct zygote_request req = { .id = id };
+    snprintf(req.cmd, sizeof(req.cmd), "%s", cmd);
+    return send(z->sock, &req, sizeof(req), 0) == sizeof(req) ? 0 : -1;
+}
+
+// Receive the next event from the zygote
+int zygote_event(struct zygote *z, struct zygote_response *resp) {
+    return recv(z->sock, resp, sizeof(*resp), 0) == sizeof(*resp) ? 0 : -1;
+}
+
+void zygote_stop(struct zygote *z) {
+    close(z->sock);
+    waitpid(z->pid, NULL, 0);
+}
+
+static double zygote_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read one command per line from stdin, run it in the sandbox, and
+// report how long it took until the job was started.
+int zygote_demo(void) {
+    struct zygote z;
+    double start = zygote_now();
+    if (zygote_start(&z) < 0) {
+        perror("zygote_start");
+        return -1;
+    }
+    printf("> zygote %d ready in %.1f us\n", z.pid, (zygote_now() - start) * 1e6);
+    printf("> enter one command per line, e.g., 'id; echo $$; ls /proc'\n");
+    fflush(stdout);
+
+    char line[256];
+    for (uint32_t id = 0; fgets(line, sizeof(line), stdin); id++) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!line[0])
+            continue;
+
+        start = zygote_now();
+        if (zygote_run(&z, id, line) < 0) {
+            perror("zygote_run");
+            break;
+        }
+
+        // Wait until our job has terminated
+        struct zygote_response resp;
+        while (zygote_event(&z, &resp) == 0) {
+            if (resp.event == ZYGOTE_STARTED) {
+                printf("> job %u: started as pid %d in %.1f us\n", resp.id,
+                       resp.pid, (zygote_now() - start) * 1e6);
+                fflush(stdout);
+            } else if (resp.event == ZYGOTE_FAILED) {
+                printf("> job %u: failed: %s\n", resp.id, strerror(resp.status));
+                break;
+            } else {
+                printf("> job %u: exited with %d after %.1f us\n", resp.id,
+                       WEXITSTATUS(resp.status), (zygote_now() - start) * 1e6);
+                fflush(stdout);
+                break;
+            }
+        }
+    }
+
+    zygote_stop(&z);
+    return 0;
+}
@@ -0,0 +1,203 @@
+/* Benchmark: How do the options of map_persistent() affect random
+ * accesses to a large persistent region?
+ *
+ * For each mode in MODES, we map SIZE bytes (default: 256M) of FILE
+ * (default: mmap.bench), and read ACCESSES (default: 1000000) random
+ * words from it. We report the time for mmap() and for the accesses,
+ * the minor and major page faults (getrusage()), and the dTLB misses
+ * (perf_event_open(), if the CPU and perf_event_paranoid allow it).
+ * From /proc/self/smaps, we learn how much of the region the kernel
+ * actually mapped with huge pages.
+ *
+ * A mode is a '+'-separated list of options:
+ *
+ *   default, populate, willneed, huge, sequential, random
+ *
+ * Once, we fill the file with data, such that its pages are read from
+ * the disk and not just zero-filled holes. Before each mode, we drop
+ * the file from the page cache, such that all modes start cold.
+ *
+ * For huge pages, place FILE on a tmpfs (with shmem_enabled=advise) or
+ * on a hugetlbfs mount. However, the pages of
+ * a tmpfs file cannot be dropped: only the first mode starts cold.
+ */
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#define BENCH_ADDR ((void *) 0x700000000000UL) // 2 MiB aligned
+
+static const struct {
+    char *name;
+    int flag;
+} bench_options[] = {
+    { "default",    0 },
+    { "populate",   PERSISTENT_POPULATE },
+    { "willneed",   PERSISTENT_WILLNEED },
+    { "huge",       PERSISTENT_HUGE },
+    { "sequential", PERSISTENT_SEQUENTIAL },
+    { "random",     PERSISTENT_RANDOM },
+};
+
+// Parse a mode like "huge+populate" into flags, or -1
+static int bench_parse_mode(char *mode) {
+    int flags = 0;
+    for (char *opt = strtok(mode, "+"); opt; opt = strtok(NULL, "+")) {
+        size_t i;
+        for (i = 0; i < sizeof(bench_options) / sizeof(*bench_options); i++)
+            if (!strcmp(opt, bench_options[i].name))
+                break;
+        if (i == sizeof(bench_options) / sizeof(*bench_options))
+            return -1;
+        flags |= bench_options[i].flag;
+    }
+    return flags;
+}
+
+// Count dTLB read misses of this process. Returns -1 if unavailable.
+static int bench_open_dtlb(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size   = sizeof(attr);
+    attr.type   = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;    // allowed with perf_event_paranoid <= 2
+    attr.exclude_hv     = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Make sure that fn has size bytes of real data, not holes. We write
+// through a mapping, which also works on hugetlbfs.
+static int bench_fill(char *fn, size_t size) {
+    int fd = open(fn, O_RDWR | O_CREAT, 0666);
+    if (fd == -1)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size == size
+        && (size_t) st.st_blocks * 512 >= size) {
+        close(fd);
+        return 0;
+    }
+
+    uint64_t *data = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+        data[i] = i;
+    munmap(data, size);
+    close(fd);
+    return 0;
+}
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int bench(void) {
+    char *FILE_ = getenv("FILE");
+    char *fn = FILE_ ? FILE_ : "mmap.bench";
+    char *SIZE = getenv("SIZE");
+    size_t size;
+    if (parse_size(SIZE ? SIZE : "256M", NULL, &size) < 0 || size == 0) {
+        fprintf(stderr, "SIZE: invalid size: %s\n", SIZE);
+        return -1;
+    }
+    char *ACCESSES = getenv("ACCESSES");
+    long accesses = atol(ACCESSES ? ACCESSES : "1000000");
+    char *MODES = getenv("MODES");
+    char modes[256];
+    snprintf(modes, sizeof(modes), "%s",
+             MODES ? MODES : "default,populate,willneed,random,huge,huge+populate");
+
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    size_t words = size / sizeof(uint64_t);
+
+    if (bench_fill(fn, size) == -1) {
+        perror(fn);
+        return -1;
+    }
+
+    int dtlb = bench_open_dtlb();
+    printf("%s: %zu MiB, %ld random reads\n", fn, size >> 20, accesses);
+    printf("%-22s %9s %9s %9s %9s %12s %9s\n", "mode", "mmap ms", "access ms",
+           "minflt", "majflt", "dTLB-misses", "huge MiB");
+
+    char *save;
+    for (char *mode = strtok_r(modes, ",", &save); mode; mode = strtok_r(NULL, ",", &save)) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s", mode);
+        int flags = bench_parse_mode(mode);
+        if (flags == -1) {
+            fprintf(stderr, "bench: unknown mode '%s'\n", name);
+            return -1;
+        }
+
+        // Start cold: write back and drop the file's cached pages
+        int fd = open(fn, O_RDWR | O_CREAT, 0666);
+        if (fd == -1) {
+            perror("open");
+            return -1;
+        }
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+
+        struct rusage ru0, ru1;
+        getrusage(RUSAGE_SELF, &ru0);
+        double t0 = bench_now();
+        if (map_persistent(fn, BENCH_ADDR, size, flags | PERSISTENT_NOREPLACE) == -1)
+            return -1;
+        double t1 = bench_now();
+
+        uint64_t dtlb0 = 0, dtlb1 = 0;
+        if (dtlb >= 0 && read(dtlb, &dtlb0, sizeof(dtlb0)) != sizeof(dtlb0))
+            dtlb0 = 0;
+
+        // xorshift64: cheap enough not to dominate the access time
+        volatile uint64_t *region = BENCH_ADDR;
+        uint64_t x = 88172645463325252ULL, sum = 0;
+        for (long i = 0; i < accesses; i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            sum += region[x % words];
+        }
+
+        if (dtlb >= 0 && read(dtlb, &dtlb1, sizeof(dtlb1)) != sizeof(dtlb1))
+            dtlb1 = dtlb0;
+        double t2 = bench_now();
+        getrusage(RUSAGE_SELF, &ru1);
+
+        char misses[24] = "n/a";
+        if (dtlb >= 0)
+            snprintf(misses, sizeof(misses), "%lu", (unsigned long) (dtlb1 - dtlb0));
+        struct smaps_mapping m;
+        unsigned long huge = smaps_find(BENCH_ADDR, &m) == 0 ? smaps_huge(&m) : 0;
+
+        printf("%-22s %9.1f %9.1f %9ld %9ld %12s %9lu\n", name,
+               (t1 - t0) * 1e3, (t2 - t1) * 1e3,
+               ru1.ru_minflt - ru0.ru_minflt, ru1.ru_majflt - ru0.ru_majflt, misses,
+               huge >> 10);
+        fflush(stdout);
+
+        munmap(BENCH_ADDR, size);
+        (void) sum;
+    }
+
+    if (dtlb >= 0)
+        close(dtlb);
+    return 0;
+}
@@ -0,0 +1,335 @@
+/* Incremental, crash-consistent checkpoints of a persistent region.
+ *
+ * With MAP_SHARED, the kernel writes modified pages back whenever it
+ * likes. After a crash, the file may contain a mix of old and new
+ * pages. And msync() of a large region has to look at every page.
+ *
+ * Here, we map the file with MAP_PRIVATE instead. Our modifications
+ * stay in (copy-on-write) memory until we call ckpt_commit(). To find
+ * the modified pages, we map the region read-only: The first write to
+ * a page raises a SIGSEGV, in which we mark the page as dirty and make
+ * it writable. Thereby, each page faults at most once per checkpoint.
+ * (The kernel's soft-dirty bits in /proc/self/pagemap would work as
+ * well, but we had to scan the pagemap of the whole region.)
+ *
+ * ckpt_commit() writes only the dirty pages, in three steps:
+ *
+ *   1. Append all dirty pages to a journal file ("FILE.journal"),
+ *      followed by a trailer with a checksum. fsync().
+ *   2. Copy the pages to their place in the data file. fdatasync().
+ *   3. Truncate the journal. fsync().
+ *
+ * If we crash before the trailer of step 1 is on disk, the data file is
+ * unmodified and we have lost the checkpoint. If we crash later,
+ * ckpt_open() finds a complete journal and replays it. Either way, the
+ * data file never contains a torn checkpoint.
+ *
+ * Limitation: The tracking only sees writes from user space. As a page
+ * is read-only until we touch it, the kernel cannot write into it on
+ * our behalf: A read() (or any other system call that writes to our
+ * memory) into a clean page of the region fails with EFAULT instead of
+ * being tracked. Write to such a buffer once before you pass it to the
+ * kernel, or read into a buffer outside the region and copy.
+ *
+ * As the signal handler needs to find the region, there is only one.
+ */
+#include <signal.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define CKPT_MAGIC 0x434b50544a4e4c31ULL  // "CKPTJNL1"
+
+struct ckpt_trailer {
+    uint64_t magic;
+    uint64_t npages;
+    uint64_t checksum;          // FNV-1a over all records
+};
+
+static struct {
+    char *addr;
+    size_t len;
+    int fd, journal_fd;
+    uint8_t *dirty;             // one byte per page
+    size_t ndirty;
+    struct sigaction old_sigsegv;
+} ckpt;
+
+static uint64_t ckpt_hash(uint64_t h, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static void ckpt_sigsegv(int signo, siginfo_t *info, void *ucontext) {
+    char *addr = info->si_addr;
+
+    if (addr < ckpt.addr || addr >= ckpt.addr + ckpt.len) {
+        // Not our fault. Let the previous handler (usually: the
+        // default action) have it on the next attempt.
+        sigaction(SIGSEGV, &ckpt.old_sigsegv, NULL);
+        (void) signo; (void) ucontext;
+        return;
+    }
+
+    size_t page = (addr - ckpt.addr) / PAGE_SIZE;
+    if (!ckpt.dirty[page]) {
+        ckpt.dirty[page] = 1;
+        ckpt.ndirty++;
+    }
+    mprotect(ckpt.addr + page * PAGE_SIZE, PAGE_SIZE, PROT_READ | PROT_WRITE);
+}
+
+// Apply a complete journal to the data file. Returns the number of
+// replayed pages, 0 for an empty or incomplete journal, or -1.
+static long ckpt_replay(int fd, int journal_fd) {
+    struct stat st;
+    if (fstat(journal_fd, &st) == -1)
+        return -1;
+
+    const size_t record = sizeof(uint64_t) + PAGE_SIZE;
+    struct ckpt_trailer t;
+    if ((size_t) st.st_size < sizeof(t) ||
+        pread(journal_fd, &t, sizeof(t), st.st_size - sizeof(t)) != sizeof(t) ||
+        t.magic != CKPT_MAGIC ||
+        t.npages * record + sizeof(t) != (uint64_t) st.st_size)
+        return 0;
+
+    // First, verify the checksum. Only then, we touch the data file.
+    static char buf[sizeof(uint64_t) + PAGE_SIZE];
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (uint64_t i = 0; i < t.npages; i++) {
+        if (pread(journal_fd, buf, record, i * record) != (ssize_t) record)
+            return -1;
+        h = ckpt_hash(h, buf, record);
+    }
+    if (h != t.checksum)
+        return 0;
+
+    for (uint64_t i = 0; i < t.npages; i++) {
+        uint64_t offset;
+        if (pread(journal_fd, buf, record, i * record) != (ssize_t) record)
+            return -1;
+        memcpy(&offset, buf, sizeof(offset));
+        if (pwrite(fd, buf + sizeof(offset), PAGE_SIZE, offset) != PAGE_SIZE)
+            return -1;
+    }
+    if (fdatasync(fd) == -1)
+        return -1;
+
+    return t.npages;
+}
+
+// Map the file fn with len bytes privately at addr. A leftover journal
+// from an interrupted checkpoint is replayed first.
+int ckpt_open(char *fn, void *addr, size_t len) {
+    char journal[256];
+    snprintf(journal, sizeof(journal), "%s.journal", fn);
+
+    ckpt.addr = MAP_FAILED;
+    ckpt.dirty = NULL;
+    ckpt.journal_fd = -1;
+    ckpt.fd = open(fn, O_RDWR | O_CREAT, 0666);
+    if (ckpt.fd == -1)
+        return -1;
+    ckpt.journal_fd = open(journal, O_RDWR | O_CREAT, 0666);
+    if (ckpt.journal_fd == -1)
+        goto fail;
+
+    long replayed = ckpt_replay(ckpt.fd, ckpt.journal_fd);
+    if (replayed == -1)
+        goto fail;
+    if (replayed > 0)
+        printf("checkpoint: replayed %ld pages from %s\n", replayed, journal);
+    if (ftruncate(ckpt.journal_fd, 0) == -1 || fsync(ckpt.journal_fd) == -1)
+        goto fail;
+
+    if (ftruncate(ckpt.fd, len) == -1)
+        goto fail;
+
+    // Kernels before Linux 4.17 treat MAP_FIXED_NOREPLACE as a hint
+    ckpt.addr = mmap(addr, len, PROT_READ, MAP_PRIVATE | MAP_FIXED_NOREPLACE, ckpt.fd, 0);
+    if (ckpt.addr != MAP_FAILED && ckpt.addr != addr) {
+        munmap(ckpt.addr, len);
+        ckpt.addr = MAP_FAILED;
+        errno = EEXIST;
+    }
+    if (ckpt.addr == MAP_FAILED)
+        goto fail;
+    ckpt.len = len;
+    ckpt.ndirty = 0;
+    ckpt.dirty = calloc(len / PAGE_SIZE, 1);
+    if (!ckpt.dirty)
+        goto fail;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = ckpt_sigsegv;
+    sa.sa_flags = SA_SIGINFO;
+    if (sigaction(SIGSEGV, &sa, &ckpt.old_sigsegv) == -1)
+        goto fail;
+    return 0;
+
+fail:;
+    int err = errno;
+    free(ckpt.dirty);
+    ckpt.dirty = NULL;
+    if (ckpt.addr != MAP_FAILED)
+        munmap(ckpt.addr, len);
+    ckpt.addr = NULL;
+    if (ckpt.journal_fd != -1)
+        close(ckpt.journal_fd);
+    close(ckpt.fd);
+    ckpt.fd = ckpt.journal_fd = -1;
+    errno = err;
+    return -1;
+}
+
+// Write out all pages that were modified since the last checkpoint.
+// Returns the number of written pages, or -1.
+long ckpt_commit(void) {
+    if (ckpt.ndirty == 0)
+        return 0;
+
+    // Step 1: Journal. We write the records with writev(), for up to
+    // 512 pages per system call.
+    struct iovec iov[1024];
+    uint64_t offsets[512];
+    int niov = 0;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t npages = ckpt.len / PAGE_SIZE;
+
+    if (ftruncate(ckpt.journal_fd, 0) == -1 || lseek(ckpt.journal_fd, 0, SEEK_SET) == -1)
+        return -1;
+    for (size_t page = 0; page <= npages; page++) {
+        if (niov == (int) (sizeof(iov) / sizeof(*iov)) || (page == npages && niov > 0)) {
+            size_t total = 0;
+            for (int i = 0; i < niov; i++)
+                total += iov[i].iov_len;
+            if (writev(ckpt.journal_fd, iov, niov) != (ssize_t) total)
+                return -1;
+            niov = 0;
+        }
+        if (page == npages || !ckpt.dirty[page])
+            continue;
+
+        uint64_t *offset = &offsets[niov / 2];
+        *offset = page * PAGE_SIZE;
+        char *data = ckpt.addr + *offset;
+        h = ckpt_hash(h, offset, sizeof(*offset));
+        h = ckpt_hash(h, data, PAGE_SIZE);
+        iov[niov++] = (struct iovec) { offset, sizeof(*offset) };
+        iov[niov++] = (struct iovec) { data, PAGE_SIZE };
+    }
+
+    struct ckpt_trailer t = { CKPT_MAGIC, ckpt.ndirty, h };
+    if (write(ckpt.journal_fd, &t, sizeof(t)) != sizeof(t) ||
+        fsync(ckpt.journal_fd) == -1)
+        return -1;
+
+    // Step 2: Copy runs of consecutive dirty pages to the data file
+    for (size_t page = 0; page < npages; ) {
+        if (!ckpt.dirty[page]) {
+            page++;
+            continue;
+        }
+        size_t first = page;
+        while (page < npages && ckpt.dirty[page])
+            page++;
+        size_t bytes = (page - first) * PAGE_SIZE;
+        if (pwrite(ckpt.fd, ckpt.addr + first * PAGE_SIZE, bytes,
+                   first * PAGE_SIZE) != (ssize_t) bytes)
+            return -1;
+    }
+    if (fdatasync(ckpt.fd) == -1)
+        return -1;
+
+    // Step 3: The checkpoint is complete; discard the journal
+    if (ftruncate(ckpt.journal_fd, 0) == -1 || fsync(ckpt.journal_fd) == -1)
+        return -1;
+
+    // Start tracking anew
+    long written = ckpt.ndirty;
+    memset(ckpt.dirty, 0, npages);
+    ckpt.ndirty = 0;
+    if (mprotect(ckpt.addr, ckpt.len, PROT_READ) == -1)
+        return -1;
+
+    return written;
+}
+
+void ckpt_close(void) {
+    sigaction(SIGSEGV, &ckpt.old_sigsegv, NULL);
+    munmap(ckpt.addr, ckpt.len);
+    free(ckpt.dirty);
+    close(ckpt.fd);
+    close(ckpt.journal_fd);
+}
+
+/* Demo: A 64 MiB region with a run counter on the first page. Each run
+ * increments the counter and writes it to DIRTY (default: 100) random
+ * pages. The pages are thus consistent iff they all carry a counter
+ * of the same or an earlier checkpoint.
+ *
+ * With CRASH=1, we _exit() after the journal is written but before
+ * the data file is updated. The next run replays the journal. */
+#define CKPT_DEMO_ADDR ((void *) 0x680000000000UL)
+#define CKPT_DEMO_SIZE (64UL << 20)
+
+int ckpt_demo(void) {
+    char *DIRTY = getenv("DIRTY");
+    int dirty = atoi(DIRTY ? DIRTY : "100");
+    bool crash = getenv("CRASH") && atoi(getenv("CRASH"));
+
+    if (ckpt_open("mmap.checkpoint", CKPT_DEMO_ADDR, CKPT_DEMO_SIZE) == -1) {
+        perror("ckpt_open");
+        return -1;
+    }
+
+    uint64_t *counter = CKPT_DEMO_ADDR;
+    printf("checkpoint: %p--%p, counter = %lu\n", CKPT_DEMO_ADDR,
+           (char *) CKPT_DEMO_ADDR + CKPT_DEMO_SIZE, (unsigned long) *counter);
+
+    // Verify that no page is from the future
+    size_t npages = CKPT_DEMO_SIZE / PAGE_SIZE, newer = 0;
+    for (size_t page = 1; page < npages; page++)
+        if (*(uint64_t *) ((char *) CKPT_DEMO_ADDR + page * PAGE_SIZE) > *counter)
+            newer++;
+    printf("checkpoint: %zu pages are newer than the counter\n", newer);
+
+    (*counter)++;
+    srand(time(NULL) ^ getpid());
+    for (int i = 0; i < dirty; i++) {
+        size_t page = 1 + rand() % (npages - 1);
+        *(uint64_t *) ((char *) CKPT_DEMO_ADDR + page * PAGE_SIZE) = *counter;
+    }
+
+    if (crash) {
+        // Without a valid data file descriptor, ckpt_commit() fails
+        // in step 2, right after the journal has reached the disk.
+        int fd = ckpt.fd;
+        ckpt.fd = -1;
+        ckpt_commit();
+        printf("checkpoint: crashed after writing %zu pages to the journal\n",
+               ckpt.ndirty);
+        ckpt.fd = fd;
+        // _exit() does not flush stdio buffers
+        fflush(stdout);
+        _exit(1);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long written = ckpt_commit();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (written == -1) {
+        perror("ckpt_commit");
+        return -1;
+    }
+    printf("checkpoint: wrote %ld dirty pages in %.2f ms\n", written,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+    ckpt_close();
+    return 0;
+}
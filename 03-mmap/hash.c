@@ -0,0 +1,394 @@
+/* A persistent hash table in the persistent heap.
+ *
+ * Since the heap is mapped at the same address in every run, the hash
+ * table is simply a pointer-based data structure that we reach through
+ * the heap's root pointer. Reopening it costs one mmap(), regardless
+ * of its size: We do not rebuild or even read the table at startup,
+ * the pages are faulted in on demand.
+ *
+ * The table uses open addressing with cache-line-sized buckets: Each
+ * 64-byte bucket holds seven 1-byte tags and seven entry pointers. The
+ * tag is derived from the hash, such that a lookup usually inspects
+ * one cache line and dereferences only the matching entry. If the home
+ * bucket is full, we probe the following buckets (linear probing). A
+ * bucket with an empty slot terminates the search. Therefore, deletion
+ * leaves a tombstone behind.
+ *
+ * Entries (hash, key, and fixed-size value) are allocated individually
+ * from the heap.
+ *
+ * If the table gets too full, we allocate a second table (twice the
+ * size, or the same size to purge tombstones) and migrate the old one
+ * incrementally: Every operation moves a few buckets. Thereby, no
+ * single operation has to pay for the whole resize. Until the
+ * migration is complete, lookups search both tables. We migrate the
+ * old table from its first bucket upwards. As the migrated buckets
+ * hold no entries anymore, a lookup in the old table starts at the
+ * first unmigrated bucket at the earliest, and ends when the probe
+ * wraps around into the migrated part.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define PHASH_MAGIC   0x5048415348763032ULL   // "PHASHv02"
+#define PHASH_SLOTS   7
+#define PHASH_EMPTY   0
+#define PHASH_DELETED 1
+#define PHASH_MIGRATE 2     // buckets to migrate per operation
+
+struct phash_entry {
+    uint64_t hash;
+    uint32_t klen;
+    char data[];            // key, '\0', value
+};
+
+struct phash_bucket {
+    uint8_t tags[PHASH_SLOTS];
+    uint8_t unused;
+    struct phash_entry *entries[PHASH_SLOTS];
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct phash_bucket) == 64, "bucket is not a cache line");
+
+struct phash_table {
+    size_t mask;            // number of buckets - 1
+    size_t used;            // non-empty slots, including tombstones
+    struct phash_bucket *buckets;
+};
+
+struct phash {
+    uint64_t magic;
+    size_t value_size;
+    size_t count;
+    struct phash_table *cur;
+    struct phash_table *old;    // being migrated into cur, or NULL
+    size_t migrated;            // buckets of old that are done
+};
+
+static uint64_t phash_hash(const char *key, size_t klen) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < klen; i++)
+        h = (h ^ (uint8_t) key[i]) * 0x100000001b3ULL;
+
+    // FNV-1a mixes the last bytes poorly into the upper bits, from
+    // which we take the tag. Finalize like MurmurHash3.
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint8_t phash_tag(uint64_t hash) {
+    return 2 + (hash >> 56) % 254;     // never EMPTY or DELETED
+}
+
+static char *phash_value(struct phash_entry *e) {
+    return e->data + e->klen + 1;
+}
+
+static struct phash_table *phash_table_new(size_t nbuckets) {
+    struct phash_table *t = pheap_alloc(sizeof(*t));
+    if (!t)
+        return NULL;
+
+    // The heap aligns blocks larger than a cache line to 64 bytes
+    size_t bytes = nbuckets * sizeof(struct phash_bucket);
+    t->buckets = pheap_alloc(bytes);
+    if (!t->buckets) {
+        pheap_free(t);
+        return NULL;
+    }
+    memset(t->buckets, 0, bytes);
+    t->mask = nbuckets - 1;
+    t->used = 0;
+    return t;
+}
+
+static void phash_table_free(struct phash_table *t) {
+    pheap_free(t->buckets);
+    pheap_free(t);
+}
+
+// Find the entry for key in t, skipping the buckets below from (which
+// are migrated already). On success, *bp and *sp are set to its bucket
+// and slot.
+static struct phash_entry *phash_table_find(struct phash_table *t, size_t from, uint64_t hash,
+                                            const char *key, size_t klen,
+                                            struct phash_bucket **bp, int *sp) {
+    uint8_t tag = phash_tag(hash);
+    size_t home = hash & t->mask;
+
+    for (size_t i = 0, b = home < from ? from : home; i <= t->mask; i++, b = (b + 1) & t->mask) {
+        if (b < from)
+            return NULL;        // wrapped around into the migrated part
+
+        struct phash_bucket *bucket = &t->buckets[b];
+        bool empty = false;
+
+        for (int s = 0; s < PHASH_SLOTS; s++) {
+            if (bucket->tags[s] == PHASH_EMPTY)
+                empty = true;
+            if (bucket->tags[s] != tag)
+                continue;
+
+            struct phash_entry *e = bucket->entries[s];
+            if (e->hash == hash && e->klen == klen && !memcmp(e->data, key, klen)) {
+                *bp = bucket;
+                *sp = s;
+                return e;
+            }
+        }
+        if (empty)
+            return NULL;
+    }
+    return NULL;
+}
+
+// Put e into the first free or deleted slot along its probe sequence.
+// The caller guarantees that there is one.
+static void phash_table_insert(struct phash_table *t, struct phash_entry *e) {
+    for (size_t b = e->hash & t->mask; ; b = (b + 1) & t->mask) {
+        struct phash_bucket *bucket = &t->buckets[b];
+        for (int s = 0; s < PHASH_SLOTS; s++) {
+            if (bucket->tags[s] > PHASH_DELETED)
+                continue;
+            if (bucket->tags[s] == PHASH_EMPTY)
+                t->used++;
+            bucket->tags[s] = phash_tag(e->hash);
+            bucket->entries[s] = e;
+            return;
+        }
+    }
+}
+
+// Move up to n buckets from the old into the current table
+static void phash_migrate(struct phash *h, size_t n) {
+    struct phash_table *old = h->old;
+    if (!old)
+        return;
+
+    for (; n > 0 && h->migrated <= old->mask; n--, h->migrated++) {
+        struct phash_bucket *bucket = &old->buckets[h->migrated];
+        for (int s = 0; s < PHASH_SLOTS; s++) {
+            if (bucket->tags[s] > PHASH_DELETED)
+                phash_table_insert(h->cur, bucket->entries[s]);
+            bucket->tags[s] = PHASH_DELETED;
+        }
+    }
+
+    if (h->migrated > old->mask) {
+        h->old = NULL;
+        phash_table_free(old);
+    }
+}
+
+// Make sure that the current table has room for one more entry
+static int phash_reserve(struct phash *h) {
+    struct phash_table *cur = h->cur;
+    size_t slots = (cur->mask + 1) * PHASH_SLOTS;
+    if ((cur->used + 1) * 4 <= slots * 3)
+        return 0;
+
+    // A previous resize is still going on: finish it first
+    if (h->old) {
+        phash_migrate(h, SIZE_MAX);
+        return phash_reserve(h);
+    }
+
+    // Grow if more than half of the slots are alive. Otherwise, the
+    // table is full of tombstones, and a rehash of the same size will do.
+    size_t nbuckets = cur->mask + 1;
+    if (h->count * 2 > slots)
+        nbuckets *= 2;
+
+    struct phash_table *t = phash_table_new(nbuckets);
+    if (!t)
+        return -1;
+    h->old = cur;
+    h->cur = t;
+    h->migrated = 0;
+    return 0;
+}
+
+// Create a new table with an initial capacity of nbuckets (a power of two)
+struct phash *phash_create(size_t value_size, size_t nbuckets) {
+    struct phash *h = pheap_alloc(sizeof(*h));
+    if (!h)
+        return NULL;
+
+    h->magic = PHASH_MAGIC;
+    h->value_size = value_size;
+    h->count = 0;
+    h->old = NULL;
+    h->migrated = 0;
+    h->cur = phash_table_new(nbuckets);
+    if (!h->cur) {
+        pheap_free(h);
+        return NULL;
+    }
+    return h;
+}
+
+// Returns a pointer to the value of key, or NULL
+void *phash_get(struct phash *h, const char *key) {
+    size_t klen = strlen(key);
+    uint64_t hash = phash_hash(key, klen);
+    struct phash_bucket *bucket;
+    int slot;
+
+    phash_migrate(h, PHASH_MIGRATE);
+    struct phash_entry *e = phash_table_find(h->cur, 0, hash, key, klen, &bucket, &slot);
+    if (!e && h->old)
+        e = phash_table_find(h->old, h->migrated, hash, key, klen, &bucket, &slot);
+    return e ? phash_value(e) : NULL;
+}
+
+// Insert or overwrite key with value_size bytes from value
+int phash_put(struct phash *h, const char *key, const void *value) {
+    size_t klen = strlen(key);
+    uint64_t hash = phash_hash(key, klen);
+    struct phash_bucket *bucket;
+    int slot;
+
+    phash_migrate(h, PHASH_MIGRATE);
+    struct phash_entry *e = phash_table_find(h->cur, 0, hash, key, klen, &bucket, &slot);
+    if (e) {
+        memcpy(phash_value(e), value, h->value_size);
+        return 0;
+    }
+
+    if (phash_reserve(h) == -1)
+        return -1;
+
+    // Not yet migrated? Then we move the entry over right away.
+    if (h->old && (e = phash_table_find(h->old, h->migrated, hash, key, klen, &bucket, &slot))) {
+        bucket->tags[slot] = PHASH_DELETED;
+    } else {
+        e = pheap_alloc(sizeof(*e) + klen + 1 + h->value_size);
+        if (!e)
+            return -1;
+        e->hash = hash;
+        e->klen = klen;
+        memcpy(e->data, key, klen + 1);
+        h->count++;
+    }
+
+    memcpy(phash_value(e), value, h->value_size);
+    phash_table_insert(h->cur, e);
+    return 0;
+}
+
+// Remove key. Returns 0 on success and -1 if there was no such key.
+int phash_del(struct phash *h, const char *key) {
+    size_t klen = strlen(key);
+    uint64_t hash = phash_hash(key, klen);
+    struct phash_bucket *bucket;
+    int slot;
+
+    phash_migrate(h, PHASH_MIGRATE);
+    struct phash_entry *e = phash_table_find(h->cur, 0, hash, key, klen, &bucket, &slot);
+    if (!e && h->old)
+        e = phash_table_find(h->old, h->migrated, hash, key, klen, &bucket, &slot);
+    if (!e)
+        return -1;
+
+    bucket->tags[slot] = PHASH_DELETED;
+    pheap_free(e);
+    h->count--;
+    return 0;
+}
+
+/* Demo: A persistent key-value store with 32-byte string values.
+ *
+ *   mmap hash put KEY VALUE
+ *   mmap hash get KEY
+ *   mmap hash del KEY
+ *   mmap hash fill N       -- put key0..keyN-1
+ *   mmap hash check N      -- get key0..keyN-1 and verify their values
+ */
+#define PHASH_DEMO_VALUE 32
+
+static double phash_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int phash_demo(int argc, char *argv[]) {
+    double start = phash_now();
+    if (pheap_open("mmap.hash", 1 << 20) == -1) {
+        perror("pheap_open");
+        return -1;
+    }
+
+    struct phash *h = pheap_root();
+    if (!h) {
+        h = phash_create(PHASH_DEMO_VALUE, 16);
+        if (!h) {
+            perror("phash_create");
+            pheap_close();
+            return -1;
+        }
+        pheap_set_root(h);
+    } else if (h->magic != PHASH_MAGIC || h->value_size != PHASH_DEMO_VALUE) {
+        fprintf(stderr, "mmap.hash: not a hash table\n");
+        pheap_close();
+        return -1;
+    }
+    printf("hash: opened %zu entries in %.1f us\n", h->count, (phash_now() - start) * 1e6);
+
+    char *cmd = argc > 0 ? argv[0] : "";
+    char value[PHASH_DEMO_VALUE] = { 0 };
+    int ret = 0;
+
+    start = phash_now();
+    if (!strcmp(cmd, "put") && argc == 3) {
+        snprintf(value, sizeof(value), "%s", argv[2]);
+        ret = phash_put(h, argv[1], value);
+    } else if (!strcmp(cmd, "get") && argc == 2) {
+        char *v = phash_get(h, argv[1]);
+        if (v)
+            printf("%s = %.*s\n", argv[1], PHASH_DEMO_VALUE, v);
+        else
+            printf("%s not found\n", argv[1]);
+    } else if (!strcmp(cmd, "del") && argc == 2) {
+        if (phash_del(h, argv[1]) == -1)
+            printf("%s not found\n", argv[1]);
+    } else if (!strcmp(cmd, "fill") && argc == 2) {
+        long n = atol(argv[1]);
+        char key[32];
+        for (long i = 0; i < n && ret == 0; i++) {
+            snprintf(key, sizeof(key), "key%ld", i);
+            snprintf(value, sizeof(value), "value%ld", i);
+            ret = phash_put(h, key, value);
+        }
+    } else if (!strcmp(cmd, "check") && argc == 2) {
+        long n = atol(argv[1]), missing = 0, wrong = 0;
+        char key[32];
+        for (long i = 0; i < n; i++) {
+            snprintf(key, sizeof(key), "key%ld", i);
+            snprintf(value, sizeof(value), "value%ld", i);
+            char *v = phash_get(h, key);
+            if (!v)
+                missing++;
+            else if (memcmp(v, value, sizeof(value)))
+                wrong++;
+        }
+        printf("hash: %ld missing, %ld wrong\n", missing, wrong);
+    } else {
+        fprintf(stderr, "usage: mmap hash put KEY VALUE | get KEY | del KEY | fill N | check N\n");
+        pheap_close();
+        return -1;
+    }
+    // Only phash_put() fails, and it sets errno
+    if (ret == -1)
+        perror(cmd);
+
+    printf("hash: %s took %.1f us, %zu entries, %zu buckets%s\n", cmd,
+           (phash_now() - start) * 1e6, h->count, h->cur->mask + 1,
+           h->old ? " (resizing)" : "");
+
+    pheap_close();
+    return ret;
+}
@@ -6,6 +6,8 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 
 #define PAGE_SIZE 4096
 
@@ -16,36 +18,119 @@ struct {
 /* Not persistent */
 int barfoo = 42;
 
-int setup_persistent(char *fn) {
+/* Options for map_persistent() */
+enum {
+    PERSISTENT_POPULATE   = 1 << 0, // fault in all pages with MAP_POPULATE
+    PERSISTENT_WILLNEED   = 1 << 1, // start asynchronous readahead
+    PERSISTENT_HUGE       = 1 << 2, // use 2 MiB pages, if possible
+    PERSISTENT_SEQUENTIAL = 1 << 3, // aggressive readahead
+    PERSISTENT_RANDOM     = 1 << 4, // no readahead
+    PERSISTENT_NOREPLACE  = 1 << 5, // fail if start is already mapped
+};
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+/* Map len bytes of the file fn at the fixed address start.
+ *
+ * Without further options, each page is faulted in on its first
+ * access. For large regions, this results in a storm of page faults
+ * right after startup. With PERSISTENT_POPULATE, mmap() faults in all
+ * pages at once. PERSISTENT_WILLNEED only starts reading the file in
+ * the background and returns immediately.
+ *
+ * With PERSISTENT_HUGE, len is rounded up to 2 MiB and start must be
+ * aligned accordingly. If fn is on a hugetlbfs, the kernel always
+ * uses huge pages. Otherwise, we ask for transparent huge pages with
+ * MADV_HUGEPAGE, which the kernel supports for anonymous memory and
+ * tmpfs (see /sys/kernel/mm/transparent_hugepage/shmem_enabled).
+ *
+ * Usually, the mapping replaces whatever is mapped at start (for the
+ * persistent section, that is the point). With PERSISTENT_NOREPLACE,
+ * it fails with EEXIST instead.
+ */
+int map_persistent(char *fn, void *start, size_t len, int flags) {
     int fd = open(fn, O_RDWR | O_CREAT, 0666);
     if (fd == -1) {
         perror("open");
         return -1;
     }
 
-    void *start = &persistent;
-    size_t len = sizeof(persistent);
+    if (flags & PERSISTENT_HUGE)
+        len = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
 
     if (ftruncate(fd, len) == -1) {
         perror("ftruncate");
+        close(fd);
         return -1;
     }
 
     void *ret = mmap(start, len,
                      PROT_READ|PROT_WRITE,
-                     MAP_SHARED | MAP_FIXED,
+                     MAP_SHARED |
+                     ((flags & PERSISTENT_NOREPLACE) ? MAP_FIXED_NOREPLACE : MAP_FIXED) |
+                     ((flags & PERSISTENT_POPULATE) ? MAP_POPULATE : 0),
                      fd, 0);
+    // Kernels before Linux 4.17 treat MAP_FIXED_NOREPLACE as a hint
+    if (ret != MAP_FAILED && ret != start) {
+        munmap(ret, len);
+        errno = EEXIST;
+        ret = MAP_FAILED;
+    }
     if (ret == MAP_FAILED) {
         perror("mmap");
+        close(fd);
         return -1;
     }
 
     close(fd);
 
+    // The hints are only advisory. Therefore, we ignore their errors
+    // (e.g., EINVAL for MADV_HUGEPAGE on a regular file).
+    if (flags & PERSISTENT_HUGE)
+        madvise(start, len, MADV_HUGEPAGE);
+    if (flags & PERSISTENT_SEQUENTIAL)
+        madvise(start, len, MADV_SEQUENTIAL);
+    if (flags & PERSISTENT_RANDOM)
+        madvise(start, len, MADV_RANDOM);
+    if (flags & PERSISTENT_WILLNEED)
+        madvise(start, len, MADV_WILLNEED);
+
     return 0;
 }
 
-int main() {
+int setup_persistent(char *fn) {
+    return map_persistent(fn, &persistent, sizeof(persistent), 0);
+}
+
+#include "../lib/smaps.c"
+#include "../lib/parse_size.c"
+#include "pheap.c"
+#include "checkpoint.c"
+#include "bench.c"
+#include "hash.c"
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && !strcmp(argv[1], "heap"))
+        return pheap_demo();
+    if (argc > 1 && !strcmp(argv[1], "checkpoint"))
+        return ckpt_demo();
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        return bench();
+    if (argc > 1 && !strcmp(argv[1], "hash"))
+        return phash_demo(argc - 2, argv + 2);
+    if (argc > 1) {
+        fprintf(stderr, "usage: %s [MODE]\n"
+                "MODE:\n"
+                "  (none)     -- increment a counter in the persistent section\n"
+                "  heap       -- keep a linked list in a persistent heap\n"
+                "  checkpoint -- crash-consistent checkpoints (env: DIRTY, CRASH)\n"
+                "  bench      -- page faults and TLB misses of random accesses\n"
+                "                (env: FILE, SIZE, ACCESSES, MODES)\n"
+                "  hash       -- persistent key-value store (put, get, del, fill, check)\n",
+                argv[0]);
+        return -1;
+    }
+
     printf("section persistent: %lx--%lx\n",
            (unsigned long) &persistent,
            (unsigned long) &persistent + sizeof(persistent));
@@ -63,16 +148,12 @@ int main() {
     printf("barfoo(%p) = %d\n", (void *) &barfoo, barfoo++);
     persistent.foobar++;
 
-    {// This is ugly and you should not do this in production code.
-
-        // In order to see the memory mappings of the currently
-        // running process, we use the pmap (for process-map) tool to
-        // query the kernel (/proc/self/maps)
-        char cmd[256];
-        snprintf(cmd, 256, "pmap %d", getpid());
-        printf("---- system(\"%s\"):\n", cmd);
-        system(cmd);
-    }
+    // In order to see the memory mappings of the currently running
+    // process, we parse /proc/self/smaps, in which the kernel describes
+    // every mapping (see ../lib/smaps.c). That is what pmap does as
+    // well, but we need not fork a shell for it.
+    printf("---- /proc/self/smaps:\n");
+    smaps_print(stdout);
 
     return 0;
 }
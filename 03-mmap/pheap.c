@@ -0,0 +1,268 @@
+/* A persistent heap: malloc() for memory that survives the process.
+ *
+ * The persistent section above holds exactly one struct. Here, we
+ * generalize the idea to a whole arena: We map a file with MAP_SHARED
+ * at a fixed virtual address (PHEAP_BASE). As the arena shows up at
+ * the same address in every run, we can store plain pointers in it.
+ * Thereby, linked lists, trees, and other pointer-rich data
+ * structures survive a restart without any (de)serialization.
+ *
+ * Layout of the file:
+ *
+ *   PHEAP_BASE: struct pheap  (magic, size, brk, root, free lists)
+ *               block, block, ...                          <- brk
+ *
+ * Each block starts with a 16-byte header that stores its size class.
+ * Size classes are powers of two, starting with 16 bytes. We allocate
+ * from the class's free list, or else by bumping brk. Blocks larger
+ * than a cache line are placed such that their payload is cache-line
+ * aligned. The padding in front of such a block belongs to the block:
+ * its header records the number of padding bytes, and the padding is
+ * reused together with the block, which stays aligned. If the arena is
+ * full, we grow the file and map the new part directly behind the old
+ * one. MAP_FIXED_NOREPLACE makes sure that we do not overwrite other
+ * mappings on the way.
+ *
+ * The root pointer is the entry point for the application: From there,
+ * it finds all of its persistent data after a restart.
+ *
+ * Note: Updates are not crash consistent. If we are killed in the
+ * middle of pheap_alloc(), the arena may leak a block. If we are killed
+ * while growing the arena, the file may be larger than the recorded
+ * size; pheap_open() then cuts it back.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#define PHEAP_BASE    ((void *) 0x600000000000UL)
+#define PHEAP_MAGIC   0x5048454150763032ULL   // "PHEAPv02"
+#define PHEAP_MIN     16                      // smallest size class
+#define PHEAP_CLASSES 32                      // 16 bytes .. 32 GiB
+#define PHEAP_ALIGN   64                      // payload alignment of large blocks
+
+struct pheap_block {
+    uint32_t class;
+    uint32_t pad;               // unused bytes in front of this header
+    struct pheap_block *next;   // only valid while on a free list
+};
+
+struct pheap {
+    uint64_t magic;
+    uint64_t size;              // mapped bytes, including this header
+    uint64_t brk;               // offset of the first unused byte
+    void *root;
+    struct pheap_block *free[PHEAP_CLASSES];
+};
+
+// As the arena is at a fixed address, so is its header
+static struct pheap *const pheap = PHEAP_BASE;
+static int pheap_fd = -1;
+
+static size_t pheap_round(size_t n) {
+    return (n + PAGE_SIZE - 1) & ~(size_t) (PAGE_SIZE - 1);
+}
+
+// Open (or create) the heap file and map it at PHEAP_BASE.
+int pheap_open(char *fn, size_t initial) {
+    int fd = open(fn, O_RDWR | O_CREAT, 0666);
+    if (fd == -1)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        goto fail;
+
+    bool fresh = st.st_size < (off_t) sizeof(struct pheap);
+    size_t size = fresh ? pheap_round(initial > sizeof(struct pheap) ? initial : 1)
+                        : (size_t) st.st_size;
+    if (fresh && ftruncate(fd, size) == -1)
+        goto fail;
+
+    // Kernels before Linux 4.17 do not know MAP_FIXED_NOREPLACE and
+    // treat the address as a hint. Therefore, we check it ourselves.
+    void *ret = mmap(PHEAP_BASE, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (ret == MAP_FAILED)
+        goto fail;
+    if (ret != PHEAP_BASE) {
+        munmap(ret, size);
+        errno = EEXIST;
+        goto fail;
+    }
+
+    if (fresh) {
+        // ftruncate() has filled the file with zeros
+        pheap->magic = PHEAP_MAGIC;
+        pheap->size  = size;
+        pheap->brk   = sizeof(struct pheap);
+    } else if (pheap->magic != PHEAP_MAGIC || pheap->size > size
+               || pheap->size < sizeof(struct pheap) || pheap->size != pheap_round(pheap->size)) {
+        munmap(PHEAP_BASE, size);
+        errno = EINVAL;
+        goto fail;
+    } else if (pheap->size < size) {
+        // We crashed in pheap_grow() after extending the file, but
+        // before we recorded the new size. Drop the unused tail.
+        munmap((char *) PHEAP_BASE + pheap->size, size - pheap->size);
+        if (ftruncate(fd, pheap->size) == -1) {
+            munmap(PHEAP_BASE, pheap->size);
+            goto fail;
+        }
+    }
+
+    pheap_fd = fd;
+    return 0;
+
+fail:;
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+// Grow the arena such that at least need more bytes fit behind brk
+static int pheap_grow(size_t need) {
+    size_t size = pheap->size * 2;
+    if (size < pheap->brk + need)
+        size = pheap_round(pheap->brk + need);
+
+    if (ftruncate(pheap_fd, size) == -1)
+        return -1;
+
+    char *end = (char *) PHEAP_BASE + pheap->size;
+    void *ret = mmap(end, size - pheap->size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED_NOREPLACE, pheap_fd, pheap->size);
+    if (ret == MAP_FAILED || ret != end) {
+        if (ret != MAP_FAILED)
+            munmap(ret, size - pheap->size);
+        ftruncate(pheap_fd, pheap->size);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pheap->size = size;
+    return 0;
+}
+
+void *pheap_alloc(size_t len) {
+    // Find the smallest class that fits the header and the payload
+    unsigned class = 0;
+    while (class < PHEAP_CLASSES &&
+           ((size_t) PHEAP_MIN << class) < len + sizeof(struct pheap_block))
+        class++;
+    if (class == PHEAP_CLASSES) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct pheap_block *b = pheap->free[class];
+    if (b) {
+        pheap->free[class] = b->next;
+    } else {
+        size_t bytes = (size_t) PHEAP_MIN << class;
+        size_t pad = 0;
+        if (bytes > PHEAP_ALIGN)
+            pad = (PHEAP_ALIGN - (pheap->brk + sizeof(*b)) % PHEAP_ALIGN) % PHEAP_ALIGN;
+        if (pheap->brk + pad + bytes > pheap->size && pheap_grow(pad + bytes) == -1)
+            return NULL;
+
+        // The padding stays in front of the header, such that the
+        // payload remains aligned when the block is reused.
+        b = (struct pheap_block *) ((char *) PHEAP_BASE + pheap->brk + pad);
+        b->class = class;
+        b->pad = pad;
+        pheap->brk += pad + bytes;
+    }
+
+    return b + 1;
+}
+
+void pheap_free(void *ptr) {
+    if (!ptr)
+        return;
+
+    struct pheap_block *b = (struct pheap_block *) ptr - 1;
+    b->next = pheap->free[b->class];
+    pheap->free[b->class] = b;
+}
+
+void *pheap_root(void) {
+    return pheap->root;
+}
+
+void pheap_set_root(void *root) {
+    pheap->root = root;
+}
+
+// Flush the arena to disk
+int pheap_sync(void) {
+    return msync(PHEAP_BASE, pheap->size, MS_SYNC);
+}
+
+void pheap_close(void) {
+    munmap(PHEAP_BASE, pheap->size);
+    close(pheap_fd);
+    pheap_fd = -1;
+}
+
+/* Demo: A persistent linked list of runs. Every invocation appends a
+ * node and drops the oldest one if there are more than four. The
+ * freed node is reused by the next run. */
+struct pheap_demo {
+    int runs;
+    struct pheap_run {
+        struct pheap_run *next;
+        int run;
+        pid_t pid;
+        char msg[32];
+    } *head;
+};
+
+int pheap_demo(void) {
+    if (pheap_open("mmap.pheap", 64 * 1024) == -1) {
+        perror("pheap_open");
+        return -1;
+    }
+
+    struct pheap_demo *demo = pheap_root();
+    if (!demo) {
+        demo = pheap_alloc(sizeof(*demo));
+        if (!demo) {
+            perror("pheap_alloc");
+            return -1;
+        }
+        memset(demo, 0, sizeof(*demo));
+        pheap_set_root(demo);
+    }
+
+    struct pheap_run *run = pheap_alloc(sizeof(*run));
+    if (!run) {
+        perror("pheap_alloc");
+        return -1;
+    }
+    run->run = demo->runs++;
+    run->pid = getpid();
+    snprintf(run->msg, sizeof(run->msg), "hello from run %d", run->run);
+
+    // Append at the tail and count the list
+    struct pheap_run **pp = &demo->head;
+    int count = 1;
+    for (; *pp; pp = &(*pp)->next)
+        count++;
+    run->next = NULL;
+    *pp = run;
+
+    if (count > 4) {
+        struct pheap_run *oldest = demo->head;
+        demo->head = oldest->next;
+        pheap_free(oldest);
+    }
+
+    printf("pheap: %p--%p, brk = %lu\n", PHEAP_BASE,
+           (char *) PHEAP_BASE + pheap->size, (unsigned long) pheap->brk);
+    for (struct pheap_run *r = demo->head; r; r = r->next)
+        printf("  %p: run %d, pid %d: %s\n", (void *) r, r->run, r->pid, r->msg);
+
+    pheap_close();
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <stdatomic.h>
 #include <sys/stat.h>
@@ -12,6 +13,15 @@
 #include <sys/time.h>
 #include <sys/syscall.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sched.h>
+#include <pthread.h>
 
 ////////////////////////////////////////////////////////////////
 // Layer 0: Futex System Call Helpers
@@ -25,8 +35,13 @@
    platforms of interest.
 
 */
+/* Number of futex system calls of this process. We use it to check
+   that the fast paths of our primitives stay in user space. */
+static long futex_calls;
+
 int futex(atomic_int *addr, int op, uint32_t val,
           struct timespec *ts, uint32_t *uaddr2, uint32_t val3) {
+    futex_calls++;
     return syscall(SYS_futex, addr, op, val, ts, uaddr2, val3);
 }
 
@@ -38,13 +53,36 @@ int futex_wait(atomic_int *addr, int val) {
     return futex(addr, FUTEX_WAIT, val, NULL, NULL, 0);
 }
 
+/* FUTEX_WAIT takes a relative timeout, which we would have to
+   recalculate after every spurious wake-up. FUTEX_WAIT_BITSET instead
+   takes an absolute CLOCK_MONOTONIC deadline (NULL: wait forever). It
+   fails with ETIMEDOUT once the deadline has passed. */
+int futex_wait_until(atomic_int *addr, int val, const struct timespec *deadline) {
+    return futex(addr, FUTEX_WAIT_BITSET, val, (struct timespec *) deadline,
+                 NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+// The CLOCK_MONOTONIC deadline timeout_ns from now
+void futex_deadline(struct timespec *deadline, long long timeout_ns) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ns / 1000000000LL;
+    deadline->tv_nsec += timeout_ns % 1000000000LL;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
 ////////////////////////////////////////////////////////////////
 // Layer 1: Semaphore Abstraction
 ////////////////////////////////////////////////////////////////
 
 /* Initialize the semaphore. This boils down to setting the referenced
-   32-bit word with the given initval */
-void sem_init(atomic_int *sem, unsigned initval) {
+   32-bit word with the given initval.
+
+   It is static, as the C library has a (weak) sem_init() for POSIX
+   semaphores, which ours would replace in the whole program. */
+static void sem_init(atomic_int *sem, unsigned initval) {
     atomic_init(sem, initval);
 }
 
@@ -60,20 +98,97 @@ bool sem_trydown(atomic_int *sem) {
 
 /* The semaphores decrement operation tries to decrement the given
    semaphore. If the semaphore counter is larger than zero, we just
-   decrement it. If it is already zero, we sleep until the value
-   becomes larger than zero and try decrementing it again. */
+   decrement it. If it is already zero, we set it to -1 to mark that
+   there are waiting threads, and sleep until the value becomes larger
+   than zero and try decrementing it again.
+
+   sem_up() only wakes someone if the semaphore was marked. As it
+   cannot know how many threads sleep, a thread that has slept hands
+   on the wake-up: If it leaves units behind, it wakes the next
+   sleeper. If it takes the last unit, it restores the mark.
+
+   sem_down_many() is the batch variant: It waits until at least one
+   unit is available and then takes as many as possible, but at most
+   max. It returns the number of units it took.
+
+   sem_down_until() additionally gives up at the deadline and returns
+   0. If it has slept, the wake-up it consumed might have been meant
+   for another sleeper. Therefore, it passes it on before it leaves. */
+// Called by a thread that slept on sem but does not take from it:
+// Hand on the wake-up, or restore the mark for the other sleepers.
+void sem_pass_on(atomic_int *sem) {
+    int fetch = 0;
+    if (atomic_load(sem) > 0)
+        futex_wake(sem, 1);
+    else
+        atomic_compare_exchange_strong(sem, &fetch, -1);
+}
+
+static int sem_down_until(atomic_int *sem, int max, const struct timespec *deadline) {
+    int fetch = atomic_load(sem);
+    bool slept = false;
+    for (;;) {
+        if (fetch > 0) {
+            int take = fetch < max ? fetch : max;
+            int next = fetch - take;
+            if (slept && next == 0)
+                next = -1;
+            if (atomic_compare_exchange_weak(sem, &fetch, next)) {
+                if (slept && next > 0)
+                    futex_wake(sem, 1);
+                return take;
+            }
+        } else if (fetch == 0) {
+            atomic_compare_exchange_weak(sem, &fetch, -1);
+        } else {
+            int timedout = futex_wait_until(sem, -1, deadline) == -1 && errno == ETIMEDOUT;
+            slept = true;
+            fetch = atomic_load(sem);
+            if (timedout && fetch <= 0) {
+                sem_pass_on(sem);
+                return 0;
+            }
+        }
+    }
+}
+
+int sem_down_many(atomic_int *sem, int max) {
+    return sem_down_until(sem, max, NULL);
+}
+
 void sem_down(atomic_int *sem) {
-    while (!sem_trydown(sem))
-        futex_wait(sem, 0);
+    if (sem_trydown(sem))
+        return;
+    sem_down_many(sem, 1);
+}
+
+// Returns false with errno set to ETIMEDOUT after timeout_ns
+bool sem_down_timeout(atomic_int *sem, long long timeout_ns) {
+    if (sem_trydown(sem))
+        return true;
+
+    struct timespec deadline;
+    futex_deadline(&deadline, timeout_ns);
+    if (sem_down_until(sem, 1, &deadline))
+        return true;
+    errno = ETIMEDOUT;
+    return false;
+}
+
+/* The semaphore increment operation increments the counter by n and
+   wakes up waiting threads, if there are waiting threads. Each woken
+   thread that leaves units behind wakes the next one, so waking one
+   would suffice; waking up to n gets them running in parallel. */
+void sem_up_many(atomic_int *sem, int n) {
+    int fetch = atomic_load(sem);
+    while (!atomic_compare_exchange_weak(sem, &fetch, fetch < 0 ? n : fetch + n))
+        ;
+    if (fetch < 0)
+        futex_wake(sem, n);
 }
 
-/* The semaphore increment operation increments the counter and wakes
-   up one waiting thread, if there is the possibility of waiting
-   threads. */
 void sem_up(atomic_int *sem) {
-    int fetch = atomic_fetch_add(sem, 1);
-    if (fetch == 0)
-        futex_wake(sem, 1);
+    sem_up_many(sem, 1);
 }
 
 ////////////////////////////////////////////////////////////////
@@ -109,11 +224,10 @@ void bb_init(struct bounded_buffer *bb) {
     bb->write_idx = 0;
 }
 
-void *bb_get(struct bounded_buffer *bb) {
+// Remove the next element, after we have decremented elements
+static void *bb_take(struct bounded_buffer *bb) {
     void *ret = NULL;
 
-    sem_down(&bb->elements);
-
     sem_down(&bb->lock);
     ret = bb->data[bb->read_idx];
     bb->read_idx = (bb->read_idx + 1) % ARRAY_SIZE(bb->data);
@@ -124,6 +238,20 @@ void *bb_get(struct bounded_buffer *bb) {
     return ret;
 }
 
+void *bb_get(struct bounded_buffer *bb) {
+    sem_down(&bb->elements);
+    return bb_take(bb);
+}
+
+// Like bb_get(), but gives up after timeout_ns. Returns false with
+// errno set to ETIMEDOUT if no element arrived in time.
+bool bb_get_timeout(struct bounded_buffer *bb, void **data, long long timeout_ns) {
+    if (!sem_down_timeout(&bb->elements, timeout_ns))
+        return false;
+    *data = bb_take(bb);
+    return true;
+}
+
 void bb_put(struct bounded_buffer *bb, void *data) {
     sem_down(&bb->slots);
 
@@ -135,8 +263,111 @@ void bb_put(struct bounded_buffer *bb, void *data) {
     sem_up(&bb->elements);
 }
 
+/* The batch variants move up to n pointers with one decrement of the
+   counting semaphore, one lock round trip, and one increment of the
+   other semaphore, instead of n of each. As the buffer only has three
+   slots, a batch is at most three elements long: bb_put_many() loops
+   until it has put all n elements, while bb_get_many() returns as soon
+   as it got at least one element. */
+void bb_put_many(struct bounded_buffer *bb, void **data, size_t n) {
+    while (n > 0) {
+        int count = sem_down_many(&bb->slots, n < INT_MAX ? (int) n : INT_MAX);
+
+        sem_down(&bb->lock);
+        for (int i = 0; i < count; i++) {
+            bb->data[bb->write_idx] = data[i];
+            bb->write_idx = (bb->write_idx + 1) % ARRAY_SIZE(bb->data);
+        }
+        sem_up(&bb->lock);
+
+        sem_up_many(&bb->elements, count);
+        data += count;
+        n -= count;
+    }
+}
+
+size_t bb_get_many(struct bounded_buffer *bb, void **data, size_t max) {
+    int count = sem_down_many(&bb->elements, max < INT_MAX ? (int) max : INT_MAX);
+
+    sem_down(&bb->lock);
+    for (int i = 0; i < count; i++) {
+        data[i] = bb->data[bb->read_idx];
+        bb->read_idx = (bb->read_idx + 1) % ARRAY_SIZE(bb->data);
+    }
+    sem_up(&bb->lock);
+
+    sem_up_many(&bb->slots, count);
+    return count;
+}
+
+////////////////////////////////////////////////////////////////
+// Helpers for the following layers and their benchmarks
+////////////////////////////////////////////////////////////////
+
+// Tell the CPU that we are busy waiting
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#include "spsc.c"
+#include "mpmc.c"
+#include "sync.c"
+#include "records.c"
+#include "waitany.c"
+#include "ipc.c"
+#include "seqlock.c"
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && !strcmp(argv[1], "spsc"))
+        return spsc_bench();
+    if (argc > 1 && !strcmp(argv[1], "mpmc"))
+        return mpmc_bench();
+    if (argc > 1 && !strcmp(argv[1], "sync"))
+        return sync_bench();
+    if (argc > 1 && !strcmp(argv[1], "records"))
+        return records_bench(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "waitany"))
+        return waitany_bench();
+    if (argc > 1 && !strcmp(argv[1], "ipc"))
+        return ipc_bench();
+    if (argc > 1 && !strcmp(argv[1], "seqlock"))
+        return seqlock_bench();
+    if (argc > 1) {
+        fprintf(stderr, "usage: %s [MODE]\n"
+                "MODE:\n"
+                "  (none) -- send a few words through the bounded buffer\n"
+                "  spsc   -- single-producer/single-consumer ring throughput\n"
+                "            (env: COUNT, CAPACITY)\n"
+                "  mpmc   -- multi-producer/multi-consumer queue throughput\n"
+                "            (env: COUNT, CAPACITY, PRODUCERS, CONSUMERS)\n"
+                "  sync   -- mutex, condvar, rwlock, and barrier\n"
+                "            (env: PROCS, ITERATIONS, SPIN)\n"
+                "  records [send|recv NAME]\n"
+                "         -- batched bounded buffer and variable-length records,\n"
+                "            or exchange lines through shared memory NAME\n"
+                "            (env: COUNT, BATCH, SIZE, CAPACITY)\n"
+                "  waitany -- timeouts, and one consumer for several bounded buffers\n"
+                "            (env: COUNT, QUEUES, CONSUMERS, TIMEOUT, FALLBACK)\n"
+                "  ipc    -- ping-pong latency and streaming throughput of futexes,\n"
+                "            pipes, eventfd, sem_t, pthread, and unix sockets\n"
+                "            (env: ROUNDS, COUNT, CPUS, MECHANISMS)\n"
+                "  seqlock -- lock-free readers of a seqlock record and a\n"
+                "            double-buffered blob (env: PROCS, ITERATIONS, BLOB, WRITE_US)\n",
+                argv[0]);
+        return -1;
+    }
+
 
-int main() {
     // First, we use mmap to establish a piece of memory that is
     // shared between the parent and the child process. The mapping is
     // 4096 bytes large a resides at the same address in the parent and the child process.
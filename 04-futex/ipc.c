@@ -0,0 +1,406 @@
+////////////////////////////////////////////////////////////////
+// Layer 8: IPC Benchmark
+////////////////////////////////////////////////////////////////
+
+/* How fast are our futex primitives compared to what the kernel and
+   the C library offer? We measure two things between a parent and a
+   forked child, optionally pinned to two CPUs (CPUS=parent,child):
+
+   - Ping-pong: The parent sends a number, the child sends it back.
+     We record every round trip and report percentiles, as the tail
+     latency matters as much as the median.
+   - Streaming: The child sends COUNT numbers as fast as it can, and
+     the parent receives them.
+
+   Each mechanism provides a channel in each direction (0: parent to
+   child, 1: child to parent) that carries 64-bit numbers. Semaphores
+   and eventfd only carry a notification. For the ping-pong, the sender
+   stores the number in a shared mailbox before it signals; for the
+   stream, we only count notifications. As their counters never fill
+   up, the sender of such a stream could run arbitrarily far ahead.
+   Therefore, it waits for an acknowledgment after every
+   IPC_STREAM_WINDOW notifications.
+
+   The pipe, eventfd, and socket descriptors, and all shared state,
+   are set up before the fork(), such that both processes have them.
+*/
+
+// From posix_sem.c
+struct posix_sem;
+struct posix_sem *posix_sem_create(unsigned value);
+void posix_sem_destroy(struct posix_sem *s);
+void posix_sem_post(struct posix_sem *s);
+void posix_sem_wait(struct posix_sem *s);
+
+struct ipc_mailbox {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool full;
+    uint64_t value;
+};
+
+struct ipc {
+    atomic_int sem[2];
+    struct bounded_buffer bb[2];
+    struct posix_sem *psem[2];  // own mappings, see posix_sem.c
+    struct ipc_mailbox mailbox[2];
+    uint64_t slot[2];           // the value for signal-only channels
+    int pipe[2][2];
+    int eventfd[2];
+    int socket[2];
+};
+
+struct ipc_ops {
+    char *name;
+    bool carries_data;
+    int (*setup)(struct ipc *ipc);
+    void (*teardown)(struct ipc *ipc);
+    void (*send)(struct ipc *ipc, int dir, uint64_t value);
+    uint64_t (*recv)(struct ipc *ipc, int dir);
+};
+
+static void ipc_die(const char *what) {
+    perror(what);
+    _exit(1);
+}
+
+// read()/write() all of the 8 bytes, as stream sockets may split them
+static void ipc_write(int fd, uint64_t value) {
+    char *p = (char *) &value;
+    for (size_t done = 0; done < sizeof(value); ) {
+        ssize_t n = write(fd, p + done, sizeof(value) - done);
+        if (n < 0 && errno != EINTR)
+            ipc_die("write");
+        done += n > 0 ? n : 0;
+    }
+}
+
+static uint64_t ipc_read(int fd) {
+    uint64_t value;
+    char *p = (char *) &value;
+    for (size_t done = 0; done < sizeof(value); ) {
+        ssize_t n = read(fd, p + done, sizeof(value) - done);
+        if (n == 0 || (n < 0 && errno != EINTR))
+            ipc_die("read");
+        done += n > 0 ? n : 0;
+    }
+    return value;
+}
+
+static void ipc_nop_teardown(struct ipc *ipc) { (void) ipc; }
+
+// Our futex semaphore
+static int ipc_sem_setup(struct ipc *ipc) {
+    sem_init(&ipc->sem[0], 0);
+    sem_init(&ipc->sem[1], 0);
+    return 0;
+}
+static void ipc_sem_send(struct ipc *ipc, int dir, uint64_t value) {
+    ipc->slot[dir] = value;
+    sem_up(&ipc->sem[dir]);
+}
+static uint64_t ipc_sem_recv(struct ipc *ipc, int dir) {
+    sem_down(&ipc->sem[dir]);
+    return ipc->slot[dir];
+}
+
+// Our bounded buffer
+static int ipc_bb_setup(struct ipc *ipc) {
+    bb_init(&ipc->bb[0]);
+    bb_init(&ipc->bb[1]);
+    return 0;
+}
+static void ipc_bb_send(struct ipc *ipc, int dir, uint64_t value) {
+    bb_put(&ipc->bb[dir], (void *) value);
+}
+static uint64_t ipc_bb_recv(struct ipc *ipc, int dir) {
+    return (uint64_t) bb_get(&ipc->bb[dir]);
+}
+
+// POSIX semaphores (process-shared sem_t), from posix_sem.c
+static int ipc_psem_setup(struct ipc *ipc) {
+    if (!(ipc->psem[0] = posix_sem_create(0)))
+        return -1;
+    if (!(ipc->psem[1] = posix_sem_create(0))) {
+        posix_sem_destroy(ipc->psem[0]);
+        return -1;
+    }
+    return 0;
+}
+static void ipc_psem_teardown(struct ipc *ipc) {
+    posix_sem_destroy(ipc->psem[0]);
+    posix_sem_destroy(ipc->psem[1]);
+}
+static void ipc_psem_send(struct ipc *ipc, int dir, uint64_t value) {
+    ipc->slot[dir] = value;
+    posix_sem_post(ipc->psem[dir]);
+}
+static uint64_t ipc_psem_recv(struct ipc *ipc, int dir) {
+    posix_sem_wait(ipc->psem[dir]);
+    return ipc->slot[dir];
+}
+
+// A one-slot mailbox with a process-shared pthread mutex and condvar
+static int ipc_pthread_setup(struct ipc *ipc) {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    for (int dir = 0; dir < 2; dir++) {
+        pthread_mutex_init(&ipc->mailbox[dir].mutex, &mattr);
+        pthread_cond_init(&ipc->mailbox[dir].cond, &cattr);
+        ipc->mailbox[dir].full = false;
+    }
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_destroy(&cattr);
+    return 0;
+}
+static void ipc_pthread_teardown(struct ipc *ipc) {
+    for (int dir = 0; dir < 2; dir++) {
+        pthread_mutex_destroy(&ipc->mailbox[dir].mutex);
+        pthread_cond_destroy(&ipc->mailbox[dir].cond);
+    }
+}
+static void ipc_pthread_send(struct ipc *ipc, int dir, uint64_t value) {
+    struct ipc_mailbox *mb = &ipc->mailbox[dir];
+    pthread_mutex_lock(&mb->mutex);
+    while (mb->full)
+        pthread_cond_wait(&mb->cond, &mb->mutex);
+    mb->value = value;
+    mb->full = true;
+    pthread_cond_signal(&mb->cond);
+    pthread_mutex_unlock(&mb->mutex);
+}
+static uint64_t ipc_pthread_recv(struct ipc *ipc, int dir) {
+    struct ipc_mailbox *mb = &ipc->mailbox[dir];
+    pthread_mutex_lock(&mb->mutex);
+    while (!mb->full)
+        pthread_cond_wait(&mb->cond, &mb->mutex);
+    uint64_t value = mb->value;
+    mb->full = false;
+    pthread_cond_signal(&mb->cond);
+    pthread_mutex_unlock(&mb->mutex);
+    return value;
+}
+
+// One pipe per direction
+static int ipc_pipe_setup(struct ipc *ipc) {
+    if (pipe(ipc->pipe[0]) < 0)
+        return -1;
+    if (pipe(ipc->pipe[1]) < 0) {
+        close(ipc->pipe[0][0]);
+        close(ipc->pipe[0][1]);
+        return -1;
+    }
+    return 0;
+}
+static void ipc_pipe_teardown(struct ipc *ipc) {
+    for (int dir = 0; dir < 2; dir++) {
+        close(ipc->pipe[dir][0]);
+        close(ipc->pipe[dir][1]);
+    }
+}
+static void ipc_pipe_send(struct ipc *ipc, int dir, uint64_t value) {
+    ipc_write(ipc->pipe[dir][1], value);
+}
+static uint64_t ipc_pipe_recv(struct ipc *ipc, int dir) {
+    return ipc_read(ipc->pipe[dir][0]);
+}
+
+// One eventfd per direction. In semaphore mode, each read consumes one
+// notification instead of the whole counter.
+static int ipc_eventfd_setup(struct ipc *ipc) {
+    if ((ipc->eventfd[0] = eventfd(0, EFD_SEMAPHORE)) < 0)
+        return -1;
+    if ((ipc->eventfd[1] = eventfd(0, EFD_SEMAPHORE)) < 0) {
+        close(ipc->eventfd[0]);
+        return -1;
+    }
+    return 0;
+}
+static void ipc_eventfd_teardown(struct ipc *ipc) {
+    close(ipc->eventfd[0]);
+    close(ipc->eventfd[1]);
+}
+static void ipc_eventfd_send(struct ipc *ipc, int dir, uint64_t value) {
+    ipc->slot[dir] = value;
+    ipc_write(ipc->eventfd[dir], 1);
+}
+static uint64_t ipc_eventfd_recv(struct ipc *ipc, int dir) {
+    ipc_read(ipc->eventfd[dir]);
+    return ipc->slot[dir];
+}
+
+// A Unix domain stream socket pair, which is bidirectional
+static int ipc_socket_setup(struct ipc *ipc) {
+    return socketpair(AF_UNIX, SOCK_STREAM, 0, ipc->socket);
+}
+static void ipc_socket_teardown(struct ipc *ipc) {
+    close(ipc->socket[0]);
+    close(ipc->socket[1]);
+}
+static void ipc_socket_send(struct ipc *ipc, int dir, uint64_t value) {
+    ipc_write(ipc->socket[dir], value);
+}
+static uint64_t ipc_socket_recv(struct ipc *ipc, int dir) {
+    return ipc_read(ipc->socket[1 - dir]);
+}
+
+static const struct ipc_ops ipc_mechanisms[] = {
+    { "futex-sem", false, ipc_sem_setup,     ipc_nop_teardown,     ipc_sem_send,     ipc_sem_recv },
+    { "futex-bb",  true,  ipc_bb_setup,      ipc_nop_teardown,     ipc_bb_send,      ipc_bb_recv },
+    { "sem_t",     false, ipc_psem_setup,    ipc_psem_teardown,    ipc_psem_send,    ipc_psem_recv },
+    { "pthread",   true,  ipc_pthread_setup, ipc_pthread_teardown, ipc_pthread_send, ipc_pthread_recv },
+    { "pipe",      true,  ipc_pipe_setup,    ipc_pipe_teardown,    ipc_pipe_send,    ipc_pipe_recv },
+    { "eventfd",   false, ipc_eventfd_setup, ipc_eventfd_teardown, ipc_eventfd_send, ipc_eventfd_recv },
+    { "unix",      true,  ipc_socket_setup,  ipc_socket_teardown,  ipc_socket_send,  ipc_socket_recv },
+};
+
+// Pin the calling process to cpu (-1: leave it alone)
+static void ipc_pin(int cpu) {
+    if (cpu < 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        fprintf(stderr, "cannot pin to CPU %d: %s\n", cpu, strerror(errno));
+}
+
+static int ipc_compare(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+// The p-th percentile of the sorted samples
+static long long ipc_percentile(long long *sorted, long n, double p) {
+    long i = (long) (p / 100.0 * n);
+    return sorted[i < n ? i : n - 1];
+}
+
+#define IPC_STREAM_WINDOW 64    // notifications in flight, see above
+
+static int ipc_run(const struct ipc_ops *ops, struct ipc *ipc, int cpus[2],
+                   long rounds, long count, long long *rtt) {
+    if (ops->setup(ipc) < 0) {
+        fprintf(stderr, "%s: ", ops->name);
+        perror("setup");
+        return -1;
+    }
+
+    // The child echoes rounds numbers, and then streams count numbers
+    pid_t child = fork();
+    if (child == -1) {
+        perror("fork");
+        ops->teardown(ipc);
+        return -1;
+    }
+    if (child == 0) {
+        ipc_pin(cpus[1]);
+        for (long i = 0; i < rounds; i++)
+            ops->send(ipc, 1, ops->recv(ipc, 0));
+        ops->recv(ipc, 0);      // start signal for the stream
+        for (long i = 1; i <= count; i++) {
+            ops->send(ipc, 1, i);
+            if (!ops->carries_data && i % IPC_STREAM_WINDOW == 0)
+                ops->recv(ipc, 0);
+        }
+        _exit(0);
+    }
+
+    int ret = 0;
+    for (long i = 0; i < rounds; i++) {
+        long long start = now_ns();
+        ops->send(ipc, 0, i);
+        uint64_t value = ops->recv(ipc, 1);
+        rtt[i] = now_ns() - start;
+        if (value != (uint64_t) i) {
+            fprintf(stderr, "%s: ping %ld came back as %lu\n", ops->name, i, (unsigned long) value);
+            ret = -1;
+        }
+    }
+
+    long long start = now_ns();
+    ops->send(ipc, 0, 0);
+    for (long i = 1; i <= count; i++) {
+        uint64_t value = ops->recv(ipc, 1);
+        if (ops->carries_data && value != (uint64_t) i && ret == 0) {
+            fprintf(stderr, "%s: stream out of order at %ld\n", ops->name, i);
+            ret = -1;
+        }
+        if (!ops->carries_data && i % IPC_STREAM_WINDOW == 0)
+            ops->send(ipc, 0, i);
+    }
+    double secs = (now_ns() - start) / 1e9;
+    waitpid(child, NULL, 0);
+    ops->teardown(ipc);
+
+    // We skip the first tenth of the rounds as warm-up
+    long skip = rounds / 10, n = rounds - skip;
+    qsort(rtt + skip, n, sizeof(*rtt), ipc_compare);
+    printf("%-10s %8lld %8lld %8lld %8lld %8lld %12.0f%s\n", ops->name,
+           ipc_percentile(rtt + skip, n, 50), ipc_percentile(rtt + skip, n, 90),
+           ipc_percentile(rtt + skip, n, 99), ipc_percentile(rtt + skip, n, 99.9),
+           rtt[rounds - 1], count / secs, ops->carries_data ? "" : "  (notifications)");
+    fflush(stdout);
+    return ret;
+}
+
+/* Env: ROUNDS (default: 100000) ping-pongs, COUNT (default: 1000000)
+   streamed numbers, CPUS=parent,child (default: no pinning), and
+   MECHANISMS, a comma-separated list of names (default: all). */
+int ipc_bench(void) {
+    char *ROUNDS = getenv("ROUNDS");
+    long rounds = atol(ROUNDS ? ROUNDS : "100000");
+    char *COUNT = getenv("COUNT");
+    long count = atol(COUNT ? COUNT : "1000000");
+    char *CPUS = getenv("CPUS");
+    char *MECHANISMS = getenv("MECHANISMS");
+    int cpus[2] = { -1, -1 };
+    if (CPUS && sscanf(CPUS, "%d,%d", &cpus[0], &cpus[1]) != 2) {
+        fprintf(stderr, "CPUS must be two CPU numbers, like 0,1\n");
+        return -1;
+    }
+    if (rounds < 10)
+        rounds = 10;
+
+    struct ipc *ipc = mmap(NULL, sizeof(*ipc), PROT_READ | PROT_WRITE,
+                           MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    long long *rtt = malloc(rounds * sizeof(*rtt));
+    if (ipc == MAP_FAILED || !rtt) {
+        perror("mmap");
+        return -1;
+    }
+
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus[0] < 0)
+        printf("not pinned, %ld CPUs online\n", nproc);
+    else
+        printf("parent on CPU %d, child on CPU %d%s\n", cpus[0], cpus[1],
+               cpus[0] == cpus[1] ? " (same CPU: every message is a context switch)" : "");
+    printf("%-10s %8s %8s %8s %8s %8s %12s\n", "round trip",
+           "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns", "stream msg/s");
+
+    ipc_pin(cpus[0]);
+    int ret = 0;
+    for (size_t m = 0; m < ARRAY_SIZE(ipc_mechanisms); m++) {
+        const struct ipc_ops *ops = &ipc_mechanisms[m];
+        if (MECHANISMS) {
+            // Match whole names in the comma-separated list
+            size_t len = strlen(ops->name);
+            char *p = MECHANISMS;
+            while ((p = strstr(p, ops->name)) &&
+                   !((p == MECHANISMS || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')))
+                p += len;
+            if (!p)
+                continue;
+        }
+        ret |= ipc_run(ops, ipc, cpus, rounds, count, rtt);
+    }
+
+    free(rtt);
+    munmap(ipc, sizeof(*ipc));
+    return ret;
+}
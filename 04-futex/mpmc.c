@@ -0,0 +1,312 @@
+////////////////////////////////////////////////////////////////
+// Layer 4: Multi-Producer/Multi-Consumer Queue
+////////////////////////////////////////////////////////////////
+
+/* With several producers and consumers, the bounded buffer serializes
+   everyone on its lock semaphore. Here, we use Dmitry Vyukov's bounded
+   MPMC queue instead, which needs no lock at all:
+
+   Each slot has a sequence number that tells whose turn it is. For
+   the element at position pos (a free-running 64-bit counter), the
+   slot pos & mask is
+
+     - free for the producer of pos, if seq == pos,
+     - filled for the consumer of pos, if seq == pos + 1.
+
+   A producer claims position pos by advancing enqueue_pos with a CAS,
+   fills the slot, and publishes it with seq = pos + 1. A consumer
+   claims pos by advancing dequeue_pos, empties the slot, and hands it
+   to the producer of the next round with seq = pos + mask + 1. As
+   different positions use different slots, producers and consumers
+   only contend on their own counter.
+
+   All state lives in the queue itself; it contains no pointers. Thus,
+   it works across fork()ed processes in MAP_SHARED memory.
+
+   If the queue is empty (full), consumers (producers) spin for a
+   while and then sleep on the not_empty (not_full) futex word. It is
+   an event count: The other side only increments it, and calls
+   FUTEX_WAKE, if the corresponding waiters count is non-zero. Thus,
+   without sleepers, an operation writes no shared word besides the
+   counter and the slot. A sleeper reads the word, increments the
+   waiters count, and tries once more before it sleeps; the other side
+   publishes the slot and then (after a full fence) checks the count.
+   Either the sleeper's last try sees the slot, or the other side sees
+   the sleeper and bumps the word, such that FUTEX_WAIT returns.
+*/
+
+#define MPMC_SPIN 256           // attempts before we go to sleep
+
+struct mpmc_slot {
+    atomic_ulong seq;
+    uint64_t data;
+};
+
+struct mpmc {
+    _Alignas(CACHE_LINE) atomic_ulong enqueue_pos;
+    _Alignas(CACHE_LINE) atomic_ulong dequeue_pos;
+
+    _Alignas(CACHE_LINE) atomic_int not_empty;
+    atomic_int consumers_waiting;
+    _Alignas(CACHE_LINE) atomic_int not_full;
+    atomic_int producers_waiting;
+
+    _Alignas(CACHE_LINE) unsigned long mask;
+    _Alignas(CACHE_LINE) struct mpmc_slot slots[];
+};
+
+// Bytes of (shared) memory that a queue with capacity slots needs.
+// The capacity is rounded up to the next power of two (at least 2).
+size_t mpmc_size(unsigned capacity) {
+    unsigned n = 2;
+    while (n < capacity)
+        n *= 2;
+    return sizeof(struct mpmc) + n * sizeof(struct mpmc_slot);
+}
+
+void mpmc_init(struct mpmc *q, unsigned capacity) {
+    unsigned n = 2;
+    while (n < capacity)
+        n *= 2;
+
+    q->mask = n - 1;
+    for (unsigned i = 0; i < n; i++) {
+        atomic_init(&q->slots[i].seq, i);
+        q->slots[i].data = 0;
+    }
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    atomic_init(&q->not_empty, 0);
+    atomic_init(&q->not_full, 0);
+    atomic_init(&q->consumers_waiting, 0);
+    atomic_init(&q->producers_waiting, 0);
+}
+
+bool mpmc_tryput(struct mpmc *q, uint64_t data) {
+    unsigned long pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+
+    for (;;) {
+        struct mpmc_slot *slot = &q->slots[pos & q->mask];
+        unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long) (seq - pos);
+
+        if (diff == 0) {
+            // The slot is free: try to claim position pos
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                slot->data = data;
+                atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+                return true;
+            }
+            // pos was updated by the failed CAS
+        } else if (diff < 0) {
+            return false;       // the consumer of the last round lags behind: full
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+bool mpmc_tryget(struct mpmc *q, uint64_t *data) {
+    unsigned long pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+
+    for (;;) {
+        struct mpmc_slot *slot = &q->slots[pos & q->mask];
+        unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long) (seq - (pos + 1));
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *data = slot->data;
+                atomic_store_explicit(&slot->seq, pos + q->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;       // not yet filled: empty
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Tell the other side that we made progress, if someone waits for it
+static void mpmc_signal(atomic_int *word, atomic_int *waiting) {
+    // Order the slot update before the load of the waiters count
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(waiting)) {
+        atomic_fetch_add(word, 1);
+        futex_wake(word, 1);
+    }
+}
+
+void mpmc_put(struct mpmc *q, uint64_t data) {
+    for (int i = 0; !mpmc_tryput(q, data); i++) {
+        if (i < MPMC_SPIN) {
+            cpu_relax();
+            continue;
+        }
+
+        // We read the futex word before the last attempt. If a
+        // consumer makes room after it, FUTEX_WAIT returns at once.
+        int seen = atomic_load(&q->not_full);
+        atomic_fetch_add(&q->producers_waiting, 1);
+        bool done = mpmc_tryput(q, data);
+        if (!done)
+            futex_wait(&q->not_full, seen);
+        atomic_fetch_sub(&q->producers_waiting, 1);
+        if (done)
+            break;
+    }
+    mpmc_signal(&q->not_empty, &q->consumers_waiting);
+}
+
+uint64_t mpmc_get(struct mpmc *q) {
+    uint64_t data;
+    for (int i = 0; !mpmc_tryget(q, &data); i++) {
+        if (i < MPMC_SPIN) {
+            cpu_relax();
+            continue;
+        }
+
+        int seen = atomic_load(&q->not_empty);
+        atomic_fetch_add(&q->consumers_waiting, 1);
+        bool done = mpmc_tryget(q, &data);
+        if (!done)
+            futex_wait(&q->not_empty, seen);
+        atomic_fetch_sub(&q->consumers_waiting, 1);
+        if (done)
+            break;
+    }
+    mpmc_signal(&q->not_full, &q->producers_waiting);
+    return data;
+}
+
+/* Benchmark: For each combination of PRODUCERS and CONSUMERS (lists
+   like "1,2,4"; default: 1,2,4 each), we fork the producers and the
+   consumers, which send COUNT (default: 2000000) numbers through the
+   MPMC queue (CAPACITY slots, default: 1024), and COUNT/100 through
+   the bounded buffer. Each consumer sums up what it receives, such
+   that we can check that no element got lost or duplicated. */
+
+struct mpmc_bench_ops {
+    char *name;
+    void (*put)(void *q, uint64_t data);
+    uint64_t (*get)(void *q);
+};
+
+static void mpmc_bench_mpmc_put(void *q, uint64_t data) { mpmc_put(q, data); }
+static uint64_t mpmc_bench_mpmc_get(void *q) { return mpmc_get(q); }
+static void mpmc_bench_bb_put(void *q, uint64_t data) { bb_put(q, (void *) data); }
+static uint64_t mpmc_bench_bb_get(void *q) { return (uint64_t) bb_get(q); }
+
+static const struct mpmc_bench_ops mpmc_bench_mpmc = {
+    "mpmc", mpmc_bench_mpmc_put, mpmc_bench_mpmc_get };
+static const struct mpmc_bench_ops mpmc_bench_bb = {
+    "bb", mpmc_bench_bb_put, mpmc_bench_bb_get };
+
+static int mpmc_bench_run(const struct mpmc_bench_ops *ops, void *q,
+                          atomic_ulong *sum, int producers, int consumers, long count) {
+    pid_t pids[producers + consumers];
+    atomic_store(sum, 0);
+
+    long long start = now_ns();
+    for (int c = 0; c < consumers; c++) {
+        if ((pids[c] = fork()) == 0) {
+            // 0 is the end-of-stream marker
+            uint64_t data, local = 0;
+            while ((data = ops->get(q)) != 0)
+                local += data;
+            atomic_fetch_add(sum, local);
+            _exit(0);
+        }
+    }
+    for (int p = 0; p < producers; p++) {
+        if ((pids[consumers + p] = fork()) == 0) {
+            for (long i = 1 + p; i <= count; i += producers)
+                ops->put(q, i);
+            _exit(0);
+        }
+    }
+
+    for (int p = 0; p < producers; p++)
+        waitpid(pids[consumers + p], NULL, 0);
+    for (int c = 0; c < consumers; c++)
+        ops->put(q, 0);
+    for (int c = 0; c < consumers; c++)
+        waitpid(pids[c], NULL, 0);
+    double secs = (now_ns() - start) / 1e9;
+
+    uint64_t expected = (uint64_t) count * (count + 1) / 2;
+    printf("%-6s %3d producers %3d consumers %10ld msgs %8.3f s %12.0f msgs/s%s\n",
+           ops->name, producers, consumers, count, secs, count / secs,
+           atomic_load(sum) == expected ? "" : "  LOST OR DUPLICATED!");
+    fflush(stdout);
+    return atomic_load(sum) == expected ? 0 : -1;
+}
+
+// Check that list is a comma-separated list of numbers
+static bool mpmc_bench_list_ok(char *name, char *list) {
+    for (char *p = list; *p; ) {
+        char *end;
+        strtol(p, &end, 10);
+        if (end == p || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "%s: invalid list: %s\n", name, list);
+            return false;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+int mpmc_bench(void) {
+    char *COUNT = getenv("COUNT");
+    long count = atol(COUNT ? COUNT : "2000000");
+    char *CAPACITY = getenv("CAPACITY");
+    unsigned capacity = atoi(CAPACITY ? CAPACITY : "1024");
+    char *PRODUCERS = getenv("PRODUCERS");
+    char *CONSUMERS = getenv("CONSUMERS");
+    if (!PRODUCERS)
+        PRODUCERS = "1,2,4";
+    if (!CONSUMERS)
+        CONSUMERS = "1,2,4";
+    if (!mpmc_bench_list_ok("PRODUCERS", PRODUCERS)
+        || !mpmc_bench_list_ok("CONSUMERS", CONSUMERS))
+        return -1;
+
+    // One shared mapping for the sum, the bounded buffer, and the queue
+    size_t size = CACHE_LINE + sizeof(struct bounded_buffer) + mpmc_size(capacity);
+    char *shared = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    atomic_ulong *sum = (void *) shared;
+    struct mpmc *q = (void *) (shared + CACHE_LINE);
+    struct bounded_buffer *bb = (void *) (shared + CACHE_LINE + mpmc_size(capacity));
+
+    int ret = 0;
+    for (char *p = PRODUCERS; *p; ) {
+        int producers = strtol(p, &p, 10);
+        if (*p == ',')
+            p++;
+        for (char *c = CONSUMERS; *c; ) {
+            int consumers = strtol(c, &c, 10);
+            if (*c == ',')
+                c++;
+            if (producers < 1 || consumers < 1)
+                continue;
+
+            mpmc_init(q, capacity);
+            ret |= mpmc_bench_run(&mpmc_bench_mpmc, q, sum, producers, consumers, count);
+            bb_init(bb);
+            ret |= mpmc_bench_run(&mpmc_bench_bb, bb, sum, producers, consumers, count / 100);
+        }
+    }
+
+    munmap(shared, size);
+    return ret;
+}
@@ -0,0 +1,41 @@
+/* Process-shared POSIX semaphores for the IPC benchmark in futex.c.
+
+   They live in their own translation unit, as the sem_init() of
+   <semaphore.h> would clash with the sem_init() of our own semaphore
+   in futex.c. Each semaphore gets its own MAP_SHARED mapping, such
+   that it survives a fork() at the same address.
+*/
+#include <errno.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+struct posix_sem {
+    sem_t sem;
+};
+
+struct posix_sem *posix_sem_create(unsigned value) {
+    struct posix_sem *s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE,
+                               MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (s == MAP_FAILED)
+        return NULL;
+    if (sem_init(&s->sem, 1, value) < 0) {
+        munmap(s, sizeof(*s));
+        return NULL;
+    }
+    return s;
+}
+
+void posix_sem_destroy(struct posix_sem *s) {
+    sem_destroy(&s->sem);
+    munmap(s, sizeof(*s));
+}
+
+void posix_sem_post(struct posix_sem *s) {
+    sem_post(&s->sem);
+}
+
+void posix_sem_wait(struct posix_sem *s) {
+    while (sem_wait(&s->sem) < 0 && errno == EINTR)
+        ;
+}
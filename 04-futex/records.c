@@ -0,0 +1,458 @@
+////////////////////////////////////////////////////////////////
+// Layer 6: Variable-Length Records in Shared Memory
+////////////////////////////////////////////////////////////////
+
+/* The bounded buffer only passes pointers. They are only meaningful
+   because our child inherited the parent's address space with fork().
+   The record buffer instead stores the payload itself in the shared
+   mapping, so it also works between unrelated processes, which map
+   the same POSIX shared-memory object (shm_open) or an inherited
+   memfd at different addresses. Therefore, it contains no pointers;
+   all positions are offsets into data[].
+
+   Each record is a 32-bit length, followed by the payload, padded to
+   8 bytes. head and tail are free-running byte offsets; a record never
+   wraps around the end of data[]. If it does not fit before the end,
+   the writer fills the rest with a RECORD_WRAP marker, and the record
+   starts at offset 0.
+
+   Everything is protected by the mutex from Layer 5, and both sides
+   wait on condition variables. The batch operations rb_put_many() and
+   rb_get_many() take the mutex once and wake the other side once for
+   as many records as fit, instead of once per record.
+*/
+
+#define RECORD_MAGIC  0x5245434f52445331ULL   // "RECORDS1"
+#define RECORD_HEADER sizeof(uint32_t)
+#define RECORD_ALIGN  8
+#define RECORD_WRAP   UINT32_MAX
+
+struct record_buffer {
+    uint64_t magic;
+    uint32_t capacity;          // bytes in data[], a power of two
+    uint32_t mapped;            // bytes of the whole mapping
+
+    struct mutex lock;
+    struct cond not_empty;
+    struct cond not_full;
+    uint32_t head;              // next record to read
+    uint32_t tail;              // next record to write
+    bool closed;                // no more records will be written
+
+    _Alignas(RECORD_ALIGN) char data[];
+};
+
+// Bytes in data[] that a record with len bytes of payload occupies
+static uint32_t record_size(size_t len) {
+    return (RECORD_HEADER + len + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+}
+
+// The largest payload that fits into the buffer
+size_t rb_max_record(struct record_buffer *rb) {
+    return rb->capacity - RECORD_HEADER;
+}
+
+/* Create a record buffer with capacity bytes for records (rounded up to
+   a power of two). With a name (like "/futex-records"), it is a POSIX
+   shared-memory object that other processes can rb_open(). Without a
+   name, it lives in an anonymous memfd, which only our children share. */
+struct record_buffer *rb_create(const char *name, size_t capacity) {
+    uint32_t n = 4096;
+    while (n < capacity && n < (1U << 30))
+        n *= 2;
+    size_t size = sizeof(struct record_buffer) + n;
+
+    int fd = name ? shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600)
+                  : memfd_create("records", 0);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    struct record_buffer *rb = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (rb == MAP_FAILED)
+        return NULL;
+
+    rb->capacity = n;
+    rb->mapped = size;
+    mutex_init(&rb->lock, SYNC_SPIN_DEFAULT);
+    cond_init(&rb->not_empty, SYNC_SPIN_DEFAULT);
+    cond_init(&rb->not_full, SYNC_SPIN_DEFAULT);
+    rb->head = rb->tail = 0;
+    rb->closed = false;
+    // Publish the magic last, such that rb_open() sees a ready buffer
+    atomic_thread_fence(memory_order_release);
+    rb->magic = RECORD_MAGIC;
+    return rb;
+}
+
+// Map the record buffer that another process created with that name
+struct record_buffer *rb_open(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct record_buffer)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    struct record_buffer *rb = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED, fd, 0);
+    close(fd);
+    if (rb == MAP_FAILED)
+        return NULL;
+
+    atomic_thread_fence(memory_order_acquire);
+    if (rb->magic != RECORD_MAGIC || rb->mapped != (size_t) st.st_size) {
+        munmap(rb, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+    return rb;
+}
+
+void rb_close(struct record_buffer *rb) {
+    munmap(rb, rb->mapped);
+}
+
+// Tell the readers that no more records will come. They get all
+// records that are already in the buffer, and then end-of-stream.
+void rb_shutdown(struct record_buffer *rb) {
+    mutex_lock(&rb->lock);
+    rb->closed = true;
+    cond_broadcast(&rb->not_empty, &rb->lock);
+    mutex_unlock(&rb->lock);
+}
+
+// Append one record, if it fits. Called with the lock held.
+static bool rb_append(struct record_buffer *rb, const void *data, size_t len) {
+    uint32_t mask = rb->capacity - 1;
+    uint32_t size = record_size(len);
+    uint32_t used = rb->tail - rb->head;
+
+    // In an empty buffer, we start over at offset 0 to avoid padding
+    if (used == 0)
+        rb->head = rb->tail = 0;
+
+    uint32_t offset = rb->tail & mask;
+    uint32_t pad = offset + size > rb->capacity ? rb->capacity - offset : 0;
+    if (used + pad + size > rb->capacity)
+        return false;
+
+    if (pad) {
+        *(uint32_t *) &rb->data[offset] = RECORD_WRAP;
+        rb->tail += pad;
+        offset = 0;
+    }
+    *(uint32_t *) &rb->data[offset] = len;
+    memcpy(&rb->data[offset + RECORD_HEADER], data, len);
+    rb->tail += size;
+    return true;
+}
+
+/* Write n records. We hold the lock for as many records as fit, and
+   wake the readers once for all of them. Blocks until all records are
+   written. Returns 0, or -1 with errno set to EMSGSIZE if a record can
+   never fit (the records before it are written) or to EPIPE after
+   rb_shutdown(). */
+int rb_put_many(struct record_buffer *rb, const struct iovec *records, size_t n) {
+    size_t i = 0;
+
+    mutex_lock(&rb->lock);
+    while (i < n) {
+        if (rb->closed) {
+            mutex_unlock(&rb->lock);
+            errno = EPIPE;
+            return -1;
+        }
+        if (records[i].iov_len > rb_max_record(rb))
+            break;
+
+        size_t written = 0;
+        while (i < n && records[i].iov_len <= rb_max_record(rb)
+               && rb_append(rb, records[i].iov_base, records[i].iov_len)) {
+            i++;
+            written++;
+        }
+        if (written)
+            cond_broadcast(&rb->not_empty, &rb->lock);
+        if (i < n && records[i].iov_len <= rb_max_record(rb))
+            cond_wait(&rb->not_full, &rb->lock);
+    }
+    mutex_unlock(&rb->lock);
+
+    if (i < n) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return 0;
+}
+
+int rb_put(struct record_buffer *rb, const void *data, size_t len) {
+    struct iovec record = { (void *) data, len };
+    return rb_put_many(rb, &record, 1);
+}
+
+/* Read up to max records into buf (size bytes). The payloads are
+   stored back to back, and lens[i] is the length of the i-th one. We
+   block until at least one record is available, and then take as many
+   as fit into buf. Returns the number of records, 0 at end-of-stream,
+   or -1 with errno set to EMSGSIZE if the next record is larger than
+   buf. */
+ssize_t rb_get_many(struct record_buffer *rb, void *buf, size_t size,
+                    size_t *lens, size_t max) {
+    uint32_t mask = rb->capacity - 1;
+    char *out = buf;
+    ssize_t count = 0;
+
+    mutex_lock(&rb->lock);
+    while (rb->head == rb->tail && !rb->closed)
+        cond_wait(&rb->not_empty, &rb->lock);
+
+    while (rb->head != rb->tail && (size_t) count < max) {
+        uint32_t offset = rb->head & mask;
+        uint32_t len = *(uint32_t *) &rb->data[offset];
+        if (len == RECORD_WRAP) {
+            rb->head += rb->capacity - offset;
+            continue;
+        }
+        if (len > size) {
+            if (count == 0)
+                count = -1;
+            break;
+        }
+
+        memcpy(out, &rb->data[offset + RECORD_HEADER], len);
+        out += len;
+        size -= len;
+        lens[count++] = len;
+        rb->head += record_size(len);
+    }
+    if (count > 0)
+        cond_broadcast(&rb->not_full, &rb->lock);
+    mutex_unlock(&rb->lock);
+
+    if (count < 0)
+        errno = EMSGSIZE;
+    return count;
+}
+
+// Read one record into buf. Returns its length, or -1 at end-of-stream
+// (errno is 0) or on error.
+ssize_t rb_get(struct record_buffer *rb, void *buf, size_t size) {
+    size_t len;
+    ssize_t count = rb_get_many(rb, buf, size, &len, 1);
+    if (count == 0)
+        errno = 0;
+    return count == 1 ? (ssize_t) len : -1;
+}
+
+/* Benchmark: A forked producer sends COUNT (default: 1000000) numbers
+   through the bounded buffer and as records of 8 to SIZE (default: 64)
+   bytes through a record buffer with CAPACITY (default: 65536) bytes in
+   a memfd. It does so one by one, and in batches of BATCH (default: 32)
+   elements. The consumer checks the sequence and the payloads.
+
+   With a NAME, two unrelated processes exchange lines of text through
+   the POSIX shared-memory object of that name:
+
+     futex records recv /name   -- create it, and print what arrives
+     futex records send /name   -- send the lines of stdin
+*/
+
+// Fill a record with a pattern that the consumer can check
+static size_t records_fill(char *buf, long i, size_t max) {
+    size_t len = sizeof(i) + (unsigned long) i * 7 % (max - sizeof(i) + 1);
+    memcpy(buf, &i, sizeof(i));
+    for (size_t j = sizeof(i); j < len; j++)
+        buf[j] = (char) (i + j);
+    return len;
+}
+
+static bool records_check(const char *buf, size_t len, long i, size_t max) {
+    char expected[max];
+    return records_fill(expected, i, max) == len && !memcmp(buf, expected, len);
+}
+
+static void records_report(char *name, size_t batch, long count, long long start) {
+    double secs = (now_ns() - start) / 1e9;
+    printf("%-8s %5zu batch %10ld msgs %8.3f s %12.0f msgs/s\n",
+           name, batch, count, secs, count / secs);
+    fflush(stdout);
+}
+
+static int records_bench_bb(long count, size_t batch) {
+    struct bounded_buffer *bb = mmap(NULL, sizeof(*bb), PROT_READ | PROT_WRITE,
+                                     MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (bb == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    bb_init(bb);
+
+    void *data[batch];
+    long long start = now_ns();
+    pid_t child = fork();
+    if (child == 0) {
+        for (long i = 1; i <= count; ) {
+            size_t n = 0;
+            for (; n < batch && i <= count; n++)
+                data[n] = (void *) i++;
+            if (batch == 1)
+                bb_put(bb, data[0]);
+            else
+                bb_put_many(bb, data, n);
+        }
+        _exit(0);
+    }
+
+    int ret = 0;
+    for (long i = 1; i <= count && ret == 0; ) {
+        size_t n = 1;
+        if (batch == 1)
+            data[0] = bb_get(bb);
+        else
+            n = bb_get_many(bb, data, batch);
+        for (size_t j = 0; j < n; j++, i++) {
+            if ((long) data[j] != i) {
+                fprintf(stderr, "bb: out of order at %ld\n", i);
+                ret = -1;
+            }
+        }
+    }
+    waitpid(child, NULL, 0);
+    records_report(batch == 1 ? "bb" : "bb_many", batch, count, start);
+    munmap(bb, sizeof(*bb));
+    return ret;
+}
+
+static int records_bench_rb(long count, size_t batch, size_t capacity, size_t max) {
+    struct record_buffer *rb = rb_create(NULL, capacity);
+    if (!rb) {
+        perror("rb_create");
+        return -1;
+    }
+    if (max > rb_max_record(rb))
+        max = rb_max_record(rb);
+
+    long long start = now_ns();
+    pid_t child = fork();
+    if (child == 0) {
+        char buf[batch * max];
+        struct iovec records[batch];
+        for (long i = 1; i <= count; ) {
+            size_t n = 0;
+            for (; n < batch && i <= count; n++, i++) {
+                records[n].iov_base = buf + n * max;
+                records[n].iov_len = records_fill(buf + n * max, i, max);
+            }
+            if (rb_put_many(rb, records, n) < 0) {
+                perror("rb_put_many");
+                _exit(1);
+            }
+        }
+        rb_shutdown(rb);
+        _exit(0);
+    }
+
+    int ret = 0;
+    char buf[batch * max];
+    size_t lens[batch];
+    long i = 1;
+    ssize_t n;
+    while ((n = rb_get_many(rb, buf, sizeof(buf), lens, batch)) > 0) {
+        char *p = buf;
+        for (ssize_t j = 0; j < n; p += lens[j++], i++) {
+            if (ret == 0 && !records_check(p, lens[j], i, max)) {
+                fprintf(stderr, "records: record %ld is corrupt\n", i);
+                ret = -1;
+            }
+        }
+    }
+    if (n < 0) {
+        perror("rb_get_many");
+        ret = -1;
+    } else if (i != count + 1) {
+        fprintf(stderr, "records: got %ld records instead of %ld\n", i - 1, count);
+        ret = -1;
+    }
+    waitpid(child, NULL, 0);
+    records_report(batch == 1 ? "rb" : "rb_many", batch, count, start);
+    rb_close(rb);
+    return ret;
+}
+
+static int records_send(const char *name) {
+    struct record_buffer *rb = rb_open(name);
+    if (!rb) {
+        perror("rb_open");
+        return -1;
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), stdin)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (rb_put(rb, line, strlen(line)) < 0) {
+            perror("rb_put");
+            break;
+        }
+    }
+    rb_shutdown(rb);
+    rb_close(rb);
+    return 0;
+}
+
+static int records_recv(const char *name) {
+    struct record_buffer *rb = rb_create(name, 65536);
+    if (!rb) {
+        perror("rb_create");
+        return -1;
+    }
+    printf("waiting for records in %s\n", name);
+    fflush(stdout);
+
+    char buf[65536];
+    size_t lens[64];
+    ssize_t n;
+    while ((n = rb_get_many(rb, buf, sizeof(buf), lens, 64)) > 0) {
+        char *p = buf;
+        for (ssize_t j = 0; j < n; p += lens[j++])
+            printf("recieved: [%.*s]\n", (int) lens[j], p);
+        fflush(stdout);
+    }
+    rb_close(rb);
+    shm_unlink(name);
+    return n < 0 ? -1 : 0;
+}
+
+int records_bench(int argc, char *argv[]) {
+    if (argc == 2 && !strcmp(argv[0], "send"))
+        return records_send(argv[1]);
+    if (argc == 2 && !strcmp(argv[0], "recv"))
+        return records_recv(argv[1]);
+
+    char *COUNT = getenv("COUNT");
+    long count = atol(COUNT ? COUNT : "1000000");
+    char *BATCH = getenv("BATCH");
+    size_t batch = atoi(BATCH ? BATCH : "32");
+    char *SIZE = getenv("SIZE");
+    size_t max = atoi(SIZE ? SIZE : "64");
+    char *CAPACITY = getenv("CAPACITY");
+    size_t capacity = atoi(CAPACITY ? CAPACITY : "65536");
+    if (batch < 1)
+        batch = 1;
+    if (max < sizeof(long))
+        max = sizeof(long);
+
+    int ret = 0;
+    ret |= records_bench_bb(count / 10, 1);
+    ret |= records_bench_bb(count / 10, batch);
+    ret |= records_bench_rb(count, 1, capacity, max);
+    ret |= records_bench_rb(count, batch, capacity, max);
+    return ret;
+}
@@ -0,0 +1,374 @@
+////////////////////////////////////////////////////////////////
+// Layer 9: Seqlock and Double-Buffered Blobs
+////////////////////////////////////////////////////////////////
+
+/* Data that is read all the time but rarely changes (configuration,
+   routing tables, ...) should not need a lock: Taking even an
+   uncontended lock writes its cache line, which then bounces between
+   all reading CPUs. Here, readers never write shared memory:
+
+   - The seqlock protects a small record. The writer makes the
+     sequence number odd, updates the record, and makes it even again.
+     A reader copies the record and retries if the sequence number was
+     odd or has changed in the meantime. The record is stored as 64-bit
+     atomics, which we access with relaxed loads and stores, such that
+     the concurrent copy is no data race.
+
+   - The blob is too large to copy on every read. It exists twice; the
+     readers use one copy in place while the writer prepares the other
+     one, and then switches them by incrementing the generation counter.
+     Like with RCU, readers never wait for the writer. Unlike RCU, the
+     writer does not wait for the readers either: A reader checks at
+     the end that the writer has not started to overwrite its copy,
+     which takes two more updates, and retries otherwise.
+
+   For both, a writer holds a mutex from Layer 5, such that there is
+   only one at a time. Processes that want to know about changes sleep
+   on the sequence number (generation counter) with FUTEX_WAIT, and
+   the writer only issues a FUTEX_WAKE if someone sleeps.
+*/
+
+#define SEQLOCK_WORDS 32        // 256 bytes
+#define SEQLOCK_SPIN  1000      // retries before a reader sleeps
+
+// Sleep until *seq is no longer seen
+static void seq_wait(atomic_int *seq, atomic_int *waiters, int seen) {
+    atomic_fetch_add(waiters, 1);
+    if (atomic_load(seq) == seen)
+        futex_wait(seq, seen);
+    atomic_fetch_sub(waiters, 1);
+}
+
+static void seq_wake(atomic_int *seq, atomic_int *waiters) {
+    if (atomic_load(waiters))
+        futex_wake(seq, INT_MAX);
+}
+
+struct seqlock {
+    // Read by everyone, written only by the writer
+    _Alignas(CACHE_LINE) atomic_int seq;
+    atomic_ulong data[SEQLOCK_WORDS];
+
+    // Written by writers and sleeping processes only
+    _Alignas(CACHE_LINE) struct mutex writer;
+    atomic_int waiters;
+};
+
+void seqlock_init(struct seqlock *sl) {
+    atomic_init(&sl->seq, 0);
+    for (int i = 0; i < SEQLOCK_WORDS; i++)
+        atomic_init(&sl->data[i], 0);
+    mutex_init(&sl->writer, SYNC_SPIN_DEFAULT);
+    atomic_init(&sl->waiters, 0);
+}
+
+/* Copy the record (size bytes, at most SEQLOCK_WORDS * 8) to out.
+   Returns the sequence number of the version we read, or -1 with errno
+   set to EINVAL if size is too large (-1 is odd and thus never a
+   sequence number of a complete version). If the writer takes long (or
+   was preempted), we stop spinning and sleep until it is done. */
+int seqlock_read(struct seqlock *sl, void *out, size_t size) {
+    uint64_t words[SEQLOCK_WORDS];
+    size_t n = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    if (size > sizeof(words)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (int i = 0; ; i++) {
+        int seq = atomic_load_explicit(&sl->seq, memory_order_acquire);
+        if (seq & 1) {
+            if (i < SEQLOCK_SPIN)
+                cpu_relax();
+            else
+                seq_wait(&sl->seq, &sl->waiters, seq);
+            continue;
+        }
+
+        for (size_t w = 0; w < n; w++)
+            words[w] = atomic_load_explicit(&sl->data[w], memory_order_relaxed);
+
+        // The fence orders the loads of the data before the reload
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&sl->seq, memory_order_relaxed) == seq) {
+            memcpy(out, words, size);
+            return seq;
+        }
+    }
+}
+
+// Returns -1 with errno set to EINVAL if size is too large
+int seqlock_write(struct seqlock *sl, const void *in, size_t size) {
+    uint64_t words[SEQLOCK_WORDS] = { 0 };
+    size_t n = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    if (size > sizeof(words)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(words, in, size);
+
+    mutex_lock(&sl->writer);
+    int seq = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+    atomic_store_explicit(&sl->seq, seq + 1, memory_order_relaxed);
+    // The fence orders the odd sequence number before the data stores
+    atomic_thread_fence(memory_order_release);
+    for (size_t w = 0; w < n; w++)
+        atomic_store_explicit(&sl->data[w], words[w], memory_order_relaxed);
+    atomic_store_explicit(&sl->seq, seq + 2, memory_order_release);
+    mutex_unlock(&sl->writer);
+
+    seq_wake(&sl->seq, &sl->waiters);
+    return 0;
+}
+
+// Sleep until the record is newer than the version seen
+void seqlock_wait(struct seqlock *sl, int seen) {
+    int seq;
+    while ((seq = atomic_load(&sl->seq)) == seen || (seq & 1))
+        seq_wait(&sl->seq, &sl->waiters, seq);
+}
+
+/* The generation counter gen of a blob is even while no update is in
+   progress, and odd while the writer fills the inactive copy. Update k
+   (gen 2k-1 -> 2k) fills copy k & 1, so copy (gen >> 1) & 1 is the
+   current one. A reader that started at gen g uses copy (g >> 1) & 1,
+   which the writer starts to overwrite at gen (g & ~1) + 3. */
+struct blob {
+    _Alignas(CACHE_LINE) atomic_int gen;
+
+    _Alignas(CACHE_LINE) struct mutex writer;
+    atomic_int waiters;
+    size_t size;
+
+    _Alignas(CACHE_LINE) char data[];  // two copies of size bytes each
+};
+
+// Bytes of shared memory that a blob of size bytes needs
+size_t blob_size(size_t size) {
+    size = (size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+    return sizeof(struct blob) + 2 * size;
+}
+
+void blob_init(struct blob *b, size_t size) {
+    atomic_init(&b->gen, 0);
+    mutex_init(&b->writer, SYNC_SPIN_DEFAULT);
+    atomic_init(&b->waiters, 0);
+    b->size = (size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+    memset(b->data, 0, 2 * b->size);
+}
+
+static char *blob_copy(struct blob *b, int gen) {
+    return b->data + ((gen >> 1) & 1) * b->size;
+}
+
+/* Readers use the current copy in place between blob_read_begin() and
+   blob_read_end(). If blob_read_end() returns false, the copy was
+   overwritten while we used it, and we have to start over. Readers
+   must treat what they read as untrusted until then (e.g., no pointers
+   from it, no array indices without bounds checks). */
+const void *blob_read_begin(struct blob *b, int *gen) {
+    *gen = atomic_load_explicit(&b->gen, memory_order_acquire);
+    return blob_copy(b, *gen);
+}
+
+bool blob_read_end(struct blob *b, int gen) {
+    atomic_thread_fence(memory_order_acquire);
+    int now = atomic_load_explicit(&b->gen, memory_order_relaxed);
+    return (unsigned) now - (unsigned) (gen & ~1) < 3;
+}
+
+/* Writers get the inactive copy, which starts as a copy of the current
+   one, change it, and publish it with blob_write_end(). */
+void *blob_write_begin(struct blob *b) {
+    mutex_lock(&b->writer);
+    int gen = atomic_load_explicit(&b->gen, memory_order_relaxed);
+    atomic_store_explicit(&b->gen, gen + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    char *next = blob_copy(b, gen + 2);
+    memcpy(next, blob_copy(b, gen), b->size);
+    return next;
+}
+
+void blob_write_end(struct blob *b) {
+    int gen = atomic_load_explicit(&b->gen, memory_order_relaxed);
+    atomic_store_explicit(&b->gen, gen + 1, memory_order_release);
+    mutex_unlock(&b->writer);
+
+    seq_wake(&b->gen, &b->waiters);
+}
+
+// Sleep until there is a newer version than the one of gen
+void blob_wait(struct blob *b, int gen) {
+    int now;
+    while ((unsigned) (now = atomic_load(&b->gen)) - (unsigned) (gen & ~1) < 2)
+        seq_wait(&b->gen, &b->waiters, now);
+}
+
+/* Benchmark: PROCS (default: 4) readers read a record of SEQLOCK_WORDS
+   words and a blob of BLOB (default: 65536) bytes, ITERATIONS (default:
+   1000000) times each, while a writer updates both every WRITE_US
+   (default: 100) microseconds. In each version, all words carry the
+   version number, such that readers can detect torn reads. A watcher
+   process sleeps with seqlock_wait() and counts the changes it sees.
+   For comparison, the readers read the record under the lock semaphore
+   from Layer 1, like the bounded buffer does. */
+struct seqlock_bench {
+    struct seqlock sl;
+    atomic_int lock;
+    _Alignas(CACHE_LINE) uint64_t locked[SEQLOCK_WORDS];
+    _Alignas(CACHE_LINE) atomic_bool stop;
+    atomic_long retries;
+    atomic_long torn;
+    atomic_long notifications;
+};
+
+static bool seqlock_bench_check(const uint64_t *words, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        if (words[i] != words[0])
+            return false;
+    }
+    return true;
+}
+
+static void seqlock_bench_reader(struct seqlock_bench *s, struct blob *b,
+                                 char *mode, long iterations) {
+    uint64_t words[SEQLOCK_WORDS];
+    long torn = 0, retries = 0;
+
+    for (long i = 0; i < iterations; i++) {
+        if (!strcmp(mode, "seqlock")) {
+            seqlock_read(&s->sl, words, sizeof(words));
+            torn += !seqlock_bench_check(words, SEQLOCK_WORDS);
+        } else if (!strcmp(mode, "lock")) {
+            sem_down(&s->lock);
+            memcpy(words, s->locked, sizeof(words));
+            sem_up(&s->lock);
+            torn += !seqlock_bench_check(words, SEQLOCK_WORDS);
+        } else {
+            // Check the first, a middle, and the last word in place
+            const uint64_t *blob;
+            int gen;
+            size_t n = b->size / sizeof(uint64_t);
+            for (;;) {
+                blob = blob_read_begin(b, &gen);
+                uint64_t first = blob[0], middle = blob[n / 2], last = blob[n - 1];
+                if (blob_read_end(b, gen)) {
+                    torn += first != middle || first != last;
+                    break;
+                }
+                retries++;
+            }
+        }
+    }
+    atomic_fetch_add(&s->torn, torn);
+    atomic_fetch_add(&s->retries, retries);
+}
+
+static void seqlock_bench_writer(struct seqlock_bench *s, struct blob *b, unsigned write_us) {
+    uint64_t words[SEQLOCK_WORDS];
+    size_t n = b->size / sizeof(uint64_t);
+
+    for (uint64_t version = 1; !atomic_load(&s->stop); version++) {
+        for (int i = 0; i < SEQLOCK_WORDS; i++)
+            words[i] = version;
+        seqlock_write(&s->sl, words, sizeof(words));
+
+        sem_down(&s->lock);
+        memcpy(s->locked, words, sizeof(words));
+        sem_up(&s->lock);
+
+        uint64_t *blob = blob_write_begin(b);
+        for (size_t i = 0; i < n; i++)
+            blob[i] = version;
+        blob_write_end(b);
+
+        usleep(write_us);
+    }
+}
+
+int seqlock_bench(void) {
+    char *PROCS = getenv("PROCS");
+    int procs = atoi(PROCS ? PROCS : "4");
+    char *ITERATIONS = getenv("ITERATIONS");
+    long iterations = atol(ITERATIONS ? ITERATIONS : "1000000");
+    char *BLOB = getenv("BLOB");
+    size_t blob = atol(BLOB ? BLOB : "65536");
+    char *WRITE_US = getenv("WRITE_US");
+    unsigned write_us = atoi(WRITE_US ? WRITE_US : "100");
+    if (procs < 1)
+        procs = 1;
+    if (blob < sizeof(uint64_t))
+        blob = sizeof(uint64_t);
+
+    size_t size = sizeof(struct seqlock_bench) + blob_size(blob);
+    char *shared = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    struct seqlock_bench *s = (void *) shared;
+    struct blob *b = (void *) (shared + sizeof(*s));
+    seqlock_init(&s->sl);
+    sem_init(&s->lock, 1);
+    blob_init(b, blob);
+    atomic_init(&s->stop, false);
+
+    pid_t writer = fork();
+    if (writer == 0) {
+        seqlock_bench_writer(s, b, write_us);
+        _exit(0);
+    }
+    pid_t watcher = fork();
+    if (watcher == 0) {
+        long seen = 0;
+        int seq = atomic_load(&s->sl.seq);
+        while (!atomic_load(&s->stop)) {
+            seqlock_wait(&s->sl, seq);
+            seq = atomic_load(&s->sl.seq);
+            seen++;
+        }
+        atomic_store(&s->notifications, seen);
+        _exit(0);
+    }
+
+    int ret = 0;
+    char *modes[] = { "seqlock", "lock", "blob" };
+    for (size_t m = 0; m < ARRAY_SIZE(modes); m++) {
+        pid_t readers[procs];
+        atomic_store(&s->retries, 0);
+        atomic_store(&s->torn, 0);
+
+        long long start = now_ns();
+        for (int p = 0; p < procs; p++) {
+            if ((readers[p] = fork()) == 0) {
+                seqlock_bench_reader(s, b, modes[m], iterations);
+                _exit(0);
+            }
+        }
+        for (int p = 0; p < procs; p++)
+            waitpid(readers[p], NULL, 0);
+        double secs = (now_ns() - start) / 1e9;
+
+        long reads = procs * iterations;
+        printf("%-8s %3d readers %10ld reads %8.3f s %12.0f reads/s %8ld retries%s\n",
+               modes[m], procs, reads, secs, reads / secs, atomic_load(&s->retries),
+               atomic_load(&s->torn) ? "  TORN READS!" : "");
+        fflush(stdout);
+        if (atomic_load(&s->torn))
+            ret = -1;
+    }
+
+    // Stop the writer. Its last update wakes the watcher.
+    atomic_store(&s->stop, true);
+    waitpid(writer, NULL, 0);
+    uint64_t words[SEQLOCK_WORDS] = { 0 };
+    seqlock_write(&s->sl, words, sizeof(words));
+    waitpid(watcher, NULL, 0);
+    printf("watcher  woken %ld times for %d updates\n",
+           atomic_load(&s->notifications), atomic_load(&s->sl.seq) / 2);
+
+    munmap(shared, size);
+    return ret;
+}
@@ -0,0 +1,197 @@
+////////////////////////////////////////////////////////////////
+// Layer 3: Single-Producer/Single-Consumer Ring
+////////////////////////////////////////////////////////////////
+
+/* The bounded buffer above takes three semaphore operations per
+   element, and all producers and consumers hammer on the same cache
+   line. If there is exactly one producer and one consumer, we can do
+   much better:
+
+   - The ring has a power-of-two number of slots, chosen at runtime.
+     The indices run freely and wrap around at 2^32; the slot is
+     index & mask.
+   - Only the producer writes tail, and only the consumer writes
+     head. We place them on separate cache lines, such that the two
+     sides do not invalidate each other's line on every operation.
+     Each side also keeps a private copy of the other side's index
+     and only rereads the shared one if the ring seems full/empty.
+   - As long as the ring is neither full nor empty, put and get are
+     a load and a store. Only on the full/empty transitions, the
+     waiting side sleeps on the other side's index with FUTEX_WAIT.
+     It announces this in a *_waiting flag, such that the other side
+     only issues a FUTEX_WAKE if someone actually sleeps. The waker
+     first loads the flag, and only if it is set, clears it with an
+     atomic exchange, such that it wakes the sleeper only once, even if
+     it puts several elements before the sleeper gets to run. Without
+     sleepers, the flag stays a shared line and no read-modify-write
+     hits it.
+
+   The flag protocol is Dekker-style: The sleeper stores its flag and
+   then loads the index; the waker stores the index and then loads the
+   flag. With sequentially-consistent atomics, at least one of them
+   sees the other's store, so no wake-up can get lost.
+*/
+
+#define CACHE_LINE 64
+#define SPSC_SPIN  128          // polls before we go to sleep
+
+struct spsc {
+    // Written by the producer
+    _Alignas(CACHE_LINE) atomic_int tail;
+    unsigned cached_head;
+    atomic_int producer_waiting;
+
+    // Written by the consumer
+    _Alignas(CACHE_LINE) atomic_int head;
+    unsigned cached_tail;
+    atomic_int consumer_waiting;
+
+    // Read-only after spsc_init()
+    _Alignas(CACHE_LINE) unsigned mask;
+    _Alignas(CACHE_LINE) uint64_t slots[];
+};
+
+// Bytes of (shared) memory that a ring with capacity slots needs.
+// The capacity is rounded up to the next power of two.
+size_t spsc_size(unsigned capacity) {
+    unsigned n = 1;
+    while (n < capacity)
+        n *= 2;
+    return sizeof(struct spsc) + n * sizeof(uint64_t);
+}
+
+void spsc_init(struct spsc *q, unsigned capacity) {
+    unsigned n = 1;
+    while (n < capacity)
+        n *= 2;
+
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->producer_waiting, 0);
+    atomic_init(&q->consumer_waiting, 0);
+    q->cached_head = 0;
+    q->cached_tail = 0;
+    q->mask = n - 1;
+}
+
+// Wait until *index is no longer old. Spin first, then sleep.
+static void spsc_wait(atomic_int *index, atomic_int *waiting, unsigned old) {
+    for (int i = 0; i < SPSC_SPIN; i++) {
+        if ((unsigned) atomic_load_explicit(index, memory_order_acquire) != old)
+            return;
+        cpu_relax();
+    }
+
+    atomic_store(waiting, 1);
+    if ((unsigned) atomic_load(index) == old)
+        futex_wait(index, old);
+    atomic_store(waiting, 0);
+}
+
+void spsc_put(struct spsc *q, uint64_t value) {
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    // Full? Reload head, and wait for the consumer if it still is.
+    while (tail - q->cached_head > q->mask) {
+        q->cached_head = atomic_load_explicit(&q->head, memory_order_acquire);
+        if (tail - q->cached_head > q->mask)
+            spsc_wait(&q->head, &q->producer_waiting, q->cached_head);
+    }
+
+    q->slots[tail & q->mask] = value;
+    atomic_store(&q->tail, tail + 1);
+    if (atomic_load(&q->consumer_waiting) && atomic_exchange(&q->consumer_waiting, 0))
+        futex_wake(&q->tail, 1);
+}
+
+uint64_t spsc_get(struct spsc *q) {
+    unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    // Empty? Reload tail, and wait for the producer if it still is.
+    while (head == q->cached_tail) {
+        q->cached_tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (head == q->cached_tail)
+            spsc_wait(&q->tail, &q->consumer_waiting, head);
+    }
+
+    uint64_t value = q->slots[head & q->mask];
+    atomic_store(&q->head, head + 1);
+    if (atomic_load(&q->producer_waiting) && atomic_exchange(&q->producer_waiting, 0))
+        futex_wake(&q->head, 1);
+    return value;
+}
+
+/* Benchmark: A forked producer sends COUNT (default: 10000000)
+   numbers through the SPSC ring (CAPACITY slots, default: 4096) and
+   COUNT/100 through the bounded buffer from above. The consumer checks
+   that it receives them in order. */
+static void spsc_bench_bb(long count) {
+    struct bounded_buffer *bb = mmap(NULL, sizeof(*bb), PROT_READ | PROT_WRITE,
+                                     MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (bb == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    bb_init(bb);
+
+    long long start = now_ns();
+    pid_t child = fork();
+    if (child == 0) {
+        for (long i = 1; i <= count; i++)
+            bb_put(bb, (void *) i);
+        _exit(0);
+    }
+    for (long i = 1; i <= count; i++) {
+        if ((long) bb_get(bb) != i) {
+            fprintf(stderr, "bb: out of order at %ld\n", i);
+            exit(1);
+        }
+    }
+    waitpid(child, NULL, 0);
+    double secs = (now_ns() - start) / 1e9;
+    printf("%-8s %9zu slots %10ld msgs %8.3f s %12.0f msgs/s\n", "bb",
+           ARRAY_SIZE(bb->data), count, secs, count / secs);
+    munmap(bb, sizeof(*bb));
+}
+
+int spsc_bench(void) {
+    char *COUNT = getenv("COUNT");
+    long count = atol(COUNT ? COUNT : "10000000");
+    char *CAPACITY = getenv("CAPACITY");
+    unsigned capacity = atoi(CAPACITY ? CAPACITY : "4096");
+
+    size_t size = spsc_size(capacity);
+    struct spsc *q = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (q == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    spsc_init(q, capacity);
+
+    long long start = now_ns();
+    pid_t child = fork();
+    if (child == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (child == 0) {
+        for (long i = 1; i <= count; i++)
+            spsc_put(q, i);
+        _exit(0);
+    }
+    for (long i = 1; i <= count; i++) {
+        if (spsc_get(q) != (uint64_t) i) {
+            fprintf(stderr, "spsc: out of order at %ld\n", i);
+            return -1;
+        }
+    }
+    waitpid(child, NULL, 0);
+    double secs = (now_ns() - start) / 1e9;
+    printf("%-8s %9u slots %10ld msgs %8.3f s %12.0f msgs/s\n", "spsc",
+           q->mask + 1, count, secs, count / secs);
+    munmap(q, size);
+
+    spsc_bench_bb(count / 100);
+    return 0;
+}
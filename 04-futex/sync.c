@@ -0,0 +1,443 @@
+////////////////////////////////////////////////////////////////
+// Layer 5: Mutex, Condition Variable, Reader-Writer Lock, Barrier
+////////////////////////////////////////////////////////////////
+
+/* Process-shared synchronization primitives on top of futexes. Like
+   the semaphore, they consist only of 32-bit words without pointers,
+   and can be placed in MAP_SHARED memory.
+
+   Our goal is that the uncontended paths do not enter the kernel at
+   all: We only call FUTEX_WAKE if we know that someone sleeps (or
+   might sleep). And before a thread goes to sleep, it spins for a
+   configurable number of rounds (spin), as the holder of a lock often
+   releases it again within a few hundred cycles. On a machine with a
+   single CPU, spinning is useless; use spin = 0 there.
+*/
+
+#define SYNC_SPIN_DEFAULT 100
+
+// Spin until *word != val, for up to spin rounds. Returns the last value.
+static int sync_spin(atomic_int *word, int val, unsigned spin) {
+    int now = atomic_load_explicit(word, memory_order_relaxed);
+    for (unsigned i = 0; i < spin && now == val; i++) {
+        cpu_relax();
+        now = atomic_load_explicit(word, memory_order_relaxed);
+    }
+    return now;
+}
+
+/* Mutex: Ulrich Drepper's three-state futex mutex ("Futexes Are
+   Tricky"). The state is 0 (unlocked), 1 (locked, no waiters), or 2
+   (locked, maybe waiters). Only the unlock of state 2 issues a wake. */
+struct mutex {
+    atomic_int state;
+    unsigned spin;
+};
+
+void mutex_init(struct mutex *m, unsigned spin) {
+    atomic_init(&m->state, 0);
+    m->spin = spin;
+}
+
+bool mutex_trylock(struct mutex *m) {
+    int unlocked = 0;
+    return atomic_compare_exchange_strong(&m->state, &unlocked, 1);
+}
+
+void mutex_lock(struct mutex *m) {
+    if (mutex_trylock(m))
+        return;
+
+    for (unsigned i = 0; i < m->spin; i++) {
+        if (atomic_load_explicit(&m->state, memory_order_relaxed) == 0 && mutex_trylock(m))
+            return;
+        cpu_relax();
+    }
+
+    // Mark the mutex as contended. If it was unlocked, we got it.
+    int c = atomic_exchange(&m->state, 2);
+    while (c != 0) {
+        futex_wait(&m->state, 2);
+        c = atomic_exchange(&m->state, 2);
+    }
+}
+
+void mutex_unlock(struct mutex *m) {
+    if (atomic_fetch_sub(&m->state, 1) != 1) {
+        atomic_store(&m->state, 0);
+        futex_wake(&m->state, 1);
+    }
+}
+
+/* Condition variable: The waiters sleep on a sequence number, which
+   every signal and broadcast increments. A broadcast does not wake all
+   waiters, as they would only fight for the mutex right after.
+   Instead, FUTEX_CMP_REQUEUE wakes one of them and moves the others
+   to the futex of the mutex; they are woken one by one as the mutex is
+   unlocked. Therefore, cond_broadcast() must be called with the mutex
+   held, and waiters re-acquire the mutex in the contended state.
+
+   Before it sleeps, a waiter spins on the sequence number, as the
+   signal often follows within a few hundred cycles. A waiter that sees
+   the signal while spinning is not requeued, but takes the mutex
+   directly. */
+struct cond {
+    atomic_int seq;
+    atomic_int waiters;
+    unsigned spin;
+};
+
+void cond_init(struct cond *c, unsigned spin) {
+    atomic_init(&c->seq, 0);
+    atomic_init(&c->waiters, 0);
+    c->spin = spin;
+}
+
+void cond_wait(struct cond *c, struct mutex *m) {
+    atomic_fetch_add(&c->waiters, 1);
+    int seq = atomic_load(&c->seq);
+
+    mutex_unlock(m);
+    if (sync_spin(&c->seq, seq, c->spin) == seq)
+        futex_wait(&c->seq, seq);
+    atomic_fetch_sub(&c->waiters, 1);
+
+    // We might have been requeued to the mutex. As there could be
+    // more of us, we lock it in the contended state.
+    while (atomic_exchange(&m->state, 2) != 0)
+        futex_wait(&m->state, 2);
+}
+
+void cond_signal(struct cond *c) {
+    atomic_fetch_add(&c->seq, 1);
+    if (atomic_load(&c->waiters))
+        futex_wake(&c->seq, 1);
+}
+
+void cond_broadcast(struct cond *c, struct mutex *m) {
+    if (!atomic_load(&c->waiters)) {
+        atomic_fetch_add(&c->seq, 1);
+        return;
+    }
+
+    // The requeued waiters sleep on the mutex, so its unlock must wake
+    // them. We hold the mutex; thus, it is either in state 1 or 2.
+    atomic_store(&m->state, 2);
+
+    // FUTEX_CMP_REQUEUE fails with EAGAIN, if seq has changed since
+    // we incremented it (a concurrent cond_signal()).
+    int seq;
+    do {
+        seq = atomic_fetch_add(&c->seq, 1) + 1;
+    } while (futex(&c->seq, FUTEX_CMP_REQUEUE, 1, (struct timespec *) (long) INT_MAX,
+                   (uint32_t *) &m->state, seq) == -1 && errno == EAGAIN);
+}
+
+/* Reader-writer lock, writer preferring: As soon as a writer waits,
+   new readers have to wait as well, such that a stream of readers
+   cannot starve the writers.
+
+   state holds the number of active readers, or RWLOCK_WRITER if a
+   writer holds the lock. writers counts the writers that hold or wait
+   for the lock. Writers sleep on state, readers sleep on writers. */
+#define RWLOCK_WRITER (1 << 30)
+
+struct rwlock {
+    atomic_int state;
+    atomic_int writers;
+    atomic_int readers_waiting;
+    unsigned spin;
+};
+
+void rwlock_init(struct rwlock *rw, unsigned spin) {
+    atomic_init(&rw->state, 0);
+    atomic_init(&rw->writers, 0);
+    atomic_init(&rw->readers_waiting, 0);
+    rw->spin = spin;
+}
+
+void rwlock_read_lock(struct rwlock *rw) {
+    for (unsigned i = 0; ; i++) {
+        int writers = atomic_load(&rw->writers);
+        if (writers == 0) {
+            int s = atomic_load(&rw->state);
+            if (!(s & RWLOCK_WRITER) &&
+                atomic_compare_exchange_weak(&rw->state, &s, s + 1))
+                return;
+            continue;
+        }
+
+        if (i < rw->spin) {
+            cpu_relax();
+            continue;
+        }
+
+        // If the last writer leaves after we have read writers,
+        // FUTEX_WAIT returns immediately.
+        atomic_fetch_add(&rw->readers_waiting, 1);
+        futex_wait(&rw->writers, writers);
+        atomic_fetch_sub(&rw->readers_waiting, 1);
+    }
+}
+
+void rwlock_read_unlock(struct rwlock *rw) {
+    // The last reader hands over to a waiting writer
+    if (atomic_fetch_sub(&rw->state, 1) == 1 && atomic_load(&rw->writers))
+        futex_wake(&rw->state, 1);
+}
+
+void rwlock_write_lock(struct rwlock *rw) {
+    atomic_fetch_add(&rw->writers, 1);
+
+    for (unsigned i = 0; ; i++) {
+        int s = 0;
+        if (atomic_compare_exchange_weak(&rw->state, &s, RWLOCK_WRITER))
+            return;
+        if (i < rw->spin)
+            cpu_relax();
+        else
+            futex_wait(&rw->state, s);
+    }
+}
+
+void rwlock_write_unlock(struct rwlock *rw) {
+    atomic_store(&rw->state, 0);
+    if (atomic_fetch_sub(&rw->writers, 1) > 1)
+        futex_wake(&rw->state, 1);      // the next writer
+    else if (atomic_load(&rw->readers_waiting))
+        futex_wake(&rw->writers, INT_MAX);
+}
+
+/* Barrier: The last of n arriving threads resets the counter and
+   starts a new round by incrementing seq. The others wait for seq to
+   change. Returns true for exactly one thread per round. */
+struct barrier {
+    atomic_int count;
+    atomic_int seq;
+    atomic_int sleepers;
+    unsigned n;
+    unsigned spin;
+};
+
+void barrier_init(struct barrier *b, unsigned n, unsigned spin) {
+    atomic_init(&b->count, 0);
+    atomic_init(&b->seq, 0);
+    atomic_init(&b->sleepers, 0);
+    b->n = n;
+    b->spin = spin;
+}
+
+bool barrier_wait(struct barrier *b) {
+    int seq = atomic_load(&b->seq);
+
+    if ((unsigned) atomic_fetch_add(&b->count, 1) + 1 == b->n) {
+        atomic_store(&b->count, 0);
+        atomic_fetch_add(&b->seq, 1);
+        if (atomic_load(&b->sleepers))
+            futex_wake(&b->seq, INT_MAX);
+        return true;
+    }
+
+    while (sync_spin(&b->seq, seq, b->spin) == seq) {
+        atomic_fetch_add(&b->sleepers, 1);
+        futex_wait(&b->seq, seq);
+        atomic_fetch_sub(&b->sleepers, 1);
+    }
+    return false;
+}
+
+/* Benchmark: First, we measure the uncontended paths in one process
+   and count their futex system calls (which should be zero). Then,
+   PROCS (default: 4) processes hammer on the primitives for ITERATIONS
+   (default: 100000) rounds each:
+
+   - mutex:   increment a shared counter in the critical section
+   - rwlock:  every 10th operation is a write, the others read
+   - cond:    a producer hands out items to consumers with broadcast,
+              and waits until they have consumed each batch
+   - barrier: all processes meet in every round
+
+   SPIN sets the spin rounds (default: 100). */
+struct sync_bench {
+    struct mutex mutex;
+    struct rwlock rwlock;
+    struct cond cond;
+    struct cond drained;
+    struct barrier barrier;
+    long counter;
+    long items, consumed;
+    bool done;
+};
+
+// calls < 0: not counted (the futex calls happened in the children)
+static void sync_bench_report(char *name, long ops, long long ns, long calls) {
+    printf("%-22s %10ld ops %9.1f ns/op", name, ops, (double) ns / ops);
+    if (calls >= 0)
+        printf(" %8ld futex calls", calls);
+    printf("\n");
+    fflush(stdout);
+}
+
+// Fork procs processes that run fn(s, id, iterations), and wait for them
+static long long sync_bench_fork(struct sync_bench *s, int procs, long iterations,
+                                 void (*fn)(struct sync_bench *, int, long)) {
+    long long start = now_ns();
+    for (int p = 0; p < procs; p++) {
+        if (fork() == 0) {
+            fn(s, p, iterations);
+            _exit(0);
+        }
+    }
+    while (wait(NULL) > 0)
+        ;
+    return now_ns() - start;
+}
+
+static void sync_bench_mutex(struct sync_bench *s, int id, long iterations) {
+    (void) id;
+    for (long i = 0; i < iterations; i++) {
+        mutex_lock(&s->mutex);
+        s->counter++;
+        mutex_unlock(&s->mutex);
+    }
+}
+
+static void sync_bench_rwlock(struct sync_bench *s, int id, long iterations) {
+    volatile long sink;
+    for (long i = 0; i < iterations; i++) {
+        if ((i + id) % 10 == 0) {
+            rwlock_write_lock(&s->rwlock);
+            s->counter++;
+            rwlock_write_unlock(&s->rwlock);
+        } else {
+            rwlock_read_lock(&s->rwlock);
+            sink = s->counter;
+            rwlock_read_unlock(&s->rwlock);
+        }
+    }
+    (void) sink;
+}
+
+// Process 0 produces items in batches of 16, all others consume them.
+// The producer waits until a batch is consumed before it adds the next.
+static void sync_bench_cond(struct sync_bench *s, int id, long iterations) {
+    mutex_lock(&s->mutex);
+    if (id == 0) {
+        for (long i = 0; i < iterations; i += 16) {
+            s->items += 16;
+            cond_broadcast(&s->cond, &s->mutex);
+            while (s->items > 0)
+                cond_wait(&s->drained, &s->mutex);
+        }
+        s->done = true;
+        cond_broadcast(&s->cond, &s->mutex);
+    } else {
+        for (;;) {
+            while (s->items == 0 && !s->done)
+                cond_wait(&s->cond, &s->mutex);
+            if (s->items == 0)
+                break;
+            s->consumed++;
+            if (--s->items == 0)
+                cond_signal(&s->drained);
+        }
+    }
+    mutex_unlock(&s->mutex);
+}
+
+static void sync_bench_barrier(struct sync_bench *s, int id, long iterations) {
+    (void) id;
+    for (long i = 0; i < iterations; i++)
+        if (barrier_wait(&s->barrier))
+            s->counter++;
+}
+
+int sync_bench(void) {
+    char *PROCS = getenv("PROCS");
+    int procs = atoi(PROCS ? PROCS : "4");
+    char *ITERATIONS = getenv("ITERATIONS");
+    long iterations = atol(ITERATIONS ? ITERATIONS : "100000");
+    char *SPIN = getenv("SPIN");
+    unsigned spin = SPIN ? (unsigned) atoi(SPIN) : SYNC_SPIN_DEFAULT;
+    if (procs < 2)
+        procs = 2;
+
+    struct sync_bench *s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE,
+                                MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (s == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    mutex_init(&s->mutex, spin);
+    rwlock_init(&s->rwlock, spin);
+    cond_init(&s->cond, spin);
+    cond_init(&s->drained, spin);
+    barrier_init(&s->barrier, procs, spin);
+
+    // Uncontended: no futex calls at all
+    long calls = futex_calls;
+    long long start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        mutex_lock(&s->mutex);
+        mutex_unlock(&s->mutex);
+    }
+    sync_bench_report("mutex (uncontended)", iterations, now_ns() - start, futex_calls - calls);
+
+    calls = futex_calls;
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        rwlock_read_lock(&s->rwlock);
+        rwlock_read_unlock(&s->rwlock);
+        rwlock_write_lock(&s->rwlock);
+        rwlock_write_unlock(&s->rwlock);
+    }
+    sync_bench_report("rwlock (uncontended)", 2 * iterations, now_ns() - start, futex_calls - calls);
+
+    calls = futex_calls;
+    start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        mutex_lock(&s->mutex);
+        cond_signal(&s->cond);
+        cond_broadcast(&s->cond, &s->mutex);
+        mutex_unlock(&s->mutex);
+    }
+    sync_bench_report("cond (no waiters)", 2 * iterations, now_ns() - start, futex_calls - calls);
+
+    // Contended, with procs processes
+    int ret = 0;
+    s->counter = 0;
+    long long ns = sync_bench_fork(s, procs, iterations, sync_bench_mutex);
+    sync_bench_report("mutex", procs * iterations, ns, -1);
+    if (s->counter != procs * iterations) {
+        fprintf(stderr, "mutex: counter is %ld instead of %ld\n", s->counter, procs * iterations);
+        ret = -1;
+    }
+
+    s->counter = 0;
+    ns = sync_bench_fork(s, procs, iterations, sync_bench_rwlock);
+    sync_bench_report("rwlock (10% writes)", procs * iterations, ns, -1);
+    if (s->counter != procs * iterations / 10) {
+        fprintf(stderr, "rwlock: counter is %ld instead of %ld\n", s->counter, procs * iterations / 10);
+        ret = -1;
+    }
+
+    s->items = s->consumed = 0;
+    s->done = false;
+    ns = sync_bench_fork(s, procs, iterations, sync_bench_cond);
+    sync_bench_report("cond (broadcast)", s->consumed, ns, -1);
+    if (s->consumed != (iterations + 15) / 16 * 16) {
+        fprintf(stderr, "cond: consumed %ld items\n", s->consumed);
+        ret = -1;
+    }
+
+    s->counter = 0;
+    ns = sync_bench_fork(s, procs, iterations, sync_bench_barrier);
+    sync_bench_report("barrier", iterations, ns, -1);
+    if (s->counter != iterations) {
+        fprintf(stderr, "barrier: %ld instead of %ld rounds\n", s->counter, iterations);
+        ret = -1;
+    }
+
+    munmap(s, sizeof(*s));
+    return ret;
+}
@@ -0,0 +1,251 @@
+////////////////////////////////////////////////////////////////
+// Layer 7: Waiting on Several Bounded Buffers
+////////////////////////////////////////////////////////////////
+
+/* A consumer that serves several queues could poll them, or use one
+   thread per queue. With futex_waitv() (Linux 5.16), it can instead
+   sleep on the elements semaphores of all buffers at once, and wakes
+   up as soon as one of them gets an element.
+
+   bb_get_any() uses the same protocol as sem_down(): It marks each
+   empty semaphore with -1, such that bb_put() wakes someone, and
+   sleeps while all of them are marked. As sem_up() wakes only one
+   sleeper per semaphore, a woken consumer that takes from another
+   buffer (or none) must pass the wake-up on with sem_pass_on().
+
+   Lower indices have priority: If several buffers have elements, we
+   take from the first one.
+
+   Without futex_waitv() (ENOSYS, or FALLBACK=1 in the environment),
+   we can only sleep on one futex. We sleep on the first buffer with
+   FUTEX_WAIT for at most WAITANY_SLICE_NS, and check the others
+   afterwards. Elements in the first buffer wake us at once; the others
+   wait for up to one slice.
+*/
+
+#ifndef SYS_futex_waitv
+#define SYS_futex_waitv 449
+#endif
+
+#define WAITANY_SLICE_NS 1000000LL  // 1 ms
+
+static bool waitany_fallback;
+
+// Like sem_trydown(), but for a thread that has slept on sem
+static bool sem_trydown_woken(atomic_int *sem) {
+    int fetch = atomic_load(sem);
+    while (fetch > 0) {
+        int next = fetch == 1 ? -1 : fetch - 1;
+        if (atomic_compare_exchange_weak(sem, &fetch, next)) {
+            if (next > 0)
+                futex_wake(sem, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Sleep until one of the elements semaphores is no longer -1. Returns
+// -1 with errno set to ETIMEDOUT, if the deadline (or NULL) has passed.
+static int waitany_wait(struct bounded_buffer **bbs, int n, const struct timespec *deadline) {
+    if (!waitany_fallback) {
+        struct futex_waitv waiters[n];
+        memset(waiters, 0, sizeof(waiters));
+        for (int i = 0; i < n; i++) {
+            waiters[i].val = (uint32_t) -1;
+            waiters[i].uaddr = (uintptr_t) &bbs[i]->elements;
+            waiters[i].flags = FUTEX_32;
+        }
+
+        futex_calls++;
+        int ret = syscall(SYS_futex_waitv, waiters, n, 0, deadline, CLOCK_MONOTONIC);
+        if (ret >= 0 || errno != ENOSYS)
+            return ret;
+        waitany_fallback = true;
+    }
+
+    struct timespec slice;
+    futex_deadline(&slice, WAITANY_SLICE_NS);
+    if (deadline && timespec_before(deadline, &slice))
+        return futex_wait_until(&bbs[0]->elements, -1, deadline);
+    futex_wait_until(&bbs[0]->elements, -1, &slice);
+    return 0;
+}
+
+/* Get an element from the first of the n bounded buffers that has one.
+   Returns the index of that buffer, or -1 with errno set to ETIMEDOUT
+   after timeout_ns (negative: wait forever), or to EINVAL for more
+   than FUTEX_WAITV_MAX buffers. */
+int bb_get_any(struct bounded_buffer **bbs, int n, void **data, long long timeout_ns) {
+    if (n < 1 || n > FUTEX_WAITV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct timespec deadline;
+    if (timeout_ns >= 0)
+        futex_deadline(&deadline, timeout_ns);
+
+    bool slept = false, timedout = false;
+    for (;;) {
+        for (int i = 0; i < n; i++) {
+            atomic_int *sem = &bbs[i]->elements;
+            if (!(slept ? sem_trydown_woken(sem) : sem_trydown(sem)))
+                continue;
+
+            if (slept) {
+                for (int j = 0; j < n; j++) {
+                    if (j != i)
+                        sem_pass_on(&bbs[j]->elements);
+                }
+            }
+            *data = bb_take(bbs[i]);
+            return i;
+        }
+
+        if (timedout) {
+            for (int j = 0; j < n; j++)
+                sem_pass_on(&bbs[j]->elements);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        // Mark all semaphores. If one got an element in the meantime,
+        // we try again instead of sleeping.
+        bool ready = false;
+        for (int i = 0; i < n; i++) {
+            int fetch = 0;
+            if (!atomic_compare_exchange_strong(&bbs[i]->elements, &fetch, -1) && fetch > 0)
+                ready = true;
+        }
+        if (ready)
+            continue;
+
+        if (waitany_wait(bbs, n, timeout_ns >= 0 ? &deadline : NULL) == -1
+            && errno == ETIMEDOUT)
+            timedout = true;
+        slept = true;
+    }
+}
+
+/* Benchmark: First, we check that sem_down_timeout(), bb_get_timeout(),
+   and bb_get_any() give up after TIMEOUT (default: 100) ms on empty
+   buffers. Then, QUEUES (default: 8) forked producers send COUNT
+   (default: 100000) numbers in total through their own bounded buffer,
+   and CONSUMERS (default: 1) processes serve all buffers with
+   bb_get_any(). We check that each number arrives exactly once. */
+struct waitany_bench {
+    atomic_int sem;
+    atomic_ulong sum;
+    atomic_long received;
+    atomic_long calls;
+    struct bounded_buffer bbs[FUTEX_WAITV_MAX];
+};
+
+static void waitany_bench_timeout(char *name, long long start, long long timeout_ns, bool ok) {
+    double ms = (now_ns() - start) / 1e6;
+    printf("%-16s %8.3f ms (timeout %lld ms)%s\n", name, ms, timeout_ns / 1000000,
+           !ok && ms >= timeout_ns / 1e6 ? "" : "  WRONG!");
+    fflush(stdout);
+}
+
+int waitany_bench(void) {
+    char *COUNT = getenv("COUNT");
+    long count = atol(COUNT ? COUNT : "100000");
+    char *QUEUES = getenv("QUEUES");
+    int queues = atoi(QUEUES ? QUEUES : "8");
+    char *CONSUMERS = getenv("CONSUMERS");
+    int consumers = atoi(CONSUMERS ? CONSUMERS : "1");
+    char *TIMEOUT = getenv("TIMEOUT");
+    long long timeout_ns = atoll(TIMEOUT ? TIMEOUT : "100") * 1000000LL;
+    waitany_fallback = getenv("FALLBACK") && atoi(getenv("FALLBACK"));
+    if (queues < 1 || queues > FUTEX_WAITV_MAX)
+        queues = 8;
+    if (consumers < 1)
+        consumers = 1;
+
+    struct waitany_bench *s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE,
+                                   MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (s == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    struct bounded_buffer *bbs[queues];
+    for (int i = 0; i < queues; i++) {
+        bbs[i] = &s->bbs[i];
+        bb_init(bbs[i]);
+    }
+
+    // Timeouts on empty semaphores and buffers
+    void *data;
+    sem_init(&s->sem, 0);
+    long long start = now_ns();
+    bool ok = sem_down_timeout(&s->sem, timeout_ns);
+    waitany_bench_timeout("sem_down_timeout", start, timeout_ns, ok);
+    start = now_ns();
+    ok = bb_get_timeout(bbs[0], &data, timeout_ns);
+    waitany_bench_timeout("bb_get_timeout", start, timeout_ns, ok);
+    start = now_ns();
+    ok = bb_get_any(bbs, queues, &data, timeout_ns) >= 0;
+    waitany_bench_timeout("bb_get_any", start, timeout_ns, ok);
+
+    // Producers and consumers
+    atomic_store(&s->sum, 0);
+    atomic_store(&s->received, 0);
+    atomic_store(&s->calls, 0);
+    pid_t pids[queues + consumers];
+    start = now_ns();
+    for (int c = 0; c < consumers; c++) {
+        if ((pids[c] = fork()) == 0) {
+            long calls = futex_calls;
+            uint64_t local = 0;
+            long received = 0;
+            while (bb_get_any(bbs, queues, &data, -1) >= 0 && data != NULL) {
+                local += (uintptr_t) data;
+                received++;
+            }
+            atomic_fetch_add(&s->sum, local);
+            atomic_fetch_add(&s->received, received);
+            atomic_fetch_add(&s->calls, futex_calls - calls);
+            _exit(0);
+        }
+    }
+    for (int q = 0; q < queues; q++) {
+        if ((pids[consumers + q] = fork()) == 0) {
+            for (long i = 1 + q; i <= count; i += queues)
+                bb_put(bbs[q], (void *) i);
+            _exit(0);
+        }
+    }
+    for (int q = 0; q < queues; q++)
+        waitpid(pids[consumers + q], NULL, 0);
+    // NULL is the end-of-stream marker; one for each consumer. As the
+    // consumers prefer the first buffers, we send them once all
+    // buffers are drained.
+    for (int q = 0; q < queues; q++) {
+        while (atomic_load(&bbs[q]->elements) > 0)
+            usleep(1000);
+    }
+    for (int c = 0; c < consumers; c++)
+        bb_put(bbs[c % queues], NULL);
+    for (int c = 0; c < consumers; c++)
+        waitpid(pids[c], NULL, 0);
+    double secs = (now_ns() - start) / 1e9;
+
+    uint64_t expected = (uint64_t) count * (count + 1) / 2;
+    bool lost = atomic_load(&s->sum) != expected || atomic_load(&s->received) != count;
+    printf("%-16s %3d queues %3d consumers %8ld msgs %8.3f s %10.0f msgs/s "
+           "%6.3f futex calls/msg%s%s\n",
+           "bb_get_any", queues, consumers, count, secs, count / secs,
+           (double) atomic_load(&s->calls) / count,
+           waitany_fallback ? "  (FUTEX_WAIT fallback)" : "",
+           lost ? "  LOST OR DUPLICATED!" : "");
+    fflush(stdout);
+
+    munmap(s, sizeof(*s));
+    return lost ? -1 : 0;
+}
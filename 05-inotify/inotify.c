@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <limits.h>
+#include <string.h>
 
 /* With each inotify event, the kernel supplies us with a bit mask
  * that indicates the cause of the event. With the following table,
@@ -48,9 +49,19 @@ struct {
 
 // We already know this macro from yesterday.
 #define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(*(arr)))
-#define BUFFER_SIZE 4096
+// Large enough for a burst of events in a big tree
+#define BUFFER_SIZE 65536
+
+#include "watch.c"
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [DIR]\n"
+                "Watch DIR (default: .) and all directories below it.\n", argv[0]);
+        return 1;
+    }
+    char *root = argc > 1 ? argv[1] : ".";
 
-int main(void) {
     // We allocate a buffer to hold the inotify events, which are
     // variable in size.
     char *buffer = malloc(BUFFER_SIZE);
@@ -59,20 +70,18 @@ int main(void) {
         return 1;
     }
 
-    int fd = inotify_init();
-    if (fd == -1) {
-        perror("inotify_init");
-        return 1;
-    }
-
-    int ret = inotify_add_watch(fd, ".", IN_OPEN|IN_ACCESS|IN_CLOSE);
-    if (ret == -1) {
-        perror("inotify_add_watch");
+    // Instead of a single inotify_add_watch() for the directory, we
+    // watch the whole tree below it.
+    struct watch_tree tree;
+    if (watch_tree_init(&tree, root, IN_OPEN|IN_ACCESS|IN_CLOSE) == -1) {
+        perror("watch_tree_init");
         return 1;
     }
+    fprintf(stderr, "watching %zu directories below %s\n", tree.count, root);
 
     int len;
-    while ((len = read(fd, buffer, BUFFER_SIZE)) >= 0) {
+    bool alive = true;
+    while (alive && (len = read(tree.fd, buffer, BUFFER_SIZE)) >= 0) {
         struct inotify_event *event = (void *) buffer;
 
         /* There can be multiple events in the buffer */
@@ -81,9 +90,19 @@ int main(void) {
              ptr += sizeof(struct inotify_event) + event->len) {
 
             bool sep = false;   /* Separate flags */
+            char path[PATH_MAX];
             event = (void *) ptr;
 
-            printf("./%s: [", event->name);
+            if (event->mask & IN_Q_OVERFLOW)
+                printf("(queue overflow, rescanning)");
+            else {
+                // The wd may be unknown, if we have already removed it
+                if (watch_path(&tree, event->wd, path, sizeof(path)) < 0)
+                    strcpy(path, "?");
+                printf(event->len ? "%s/%s" : "%s", path, event->name);
+            }
+
+            printf(": [");
             for (size_t i = 0; i < ARRAY_SIZE(inotify_event_flags); i++) {
                 if (event->mask & inotify_event_flags[i].mask) {
                     if (sep)
@@ -93,13 +112,17 @@ int main(void) {
                 }
             }
             printf("]\n");
+
+            // Follow the changes of the tree
+            alive = watch_event(&tree, event);
         }
+        fflush(stdout);
     }
 
 
     // As we are nice, we free the buffer again.
 
-    close(fd);
+    watch_tree_free(&tree);
     free(buffer);
     return 0;
 }
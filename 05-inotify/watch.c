@@ -0,0 +1,424 @@
+/* Recursive watching: inotify watches single directories, not trees.
+ * To watch a tree, we have to add a watch for every directory in it,
+ * follow the directories that come and go, and map the watch
+ * descriptor (wd) of each event back to a path.
+ *
+ * For each watched directory, we store only its wd, the wd of its
+ * parent, and its own name. We compose the path by following the
+ * parents; this keeps the memory at a few dozen bytes per directory,
+ * even for deep trees with 100k+ directories, and makes renaming a
+ * directory a single update. The watches live in a hash map from wd
+ * to entry (open addressing, linear probing, no tombstones).
+ *
+ * Races: A directory can get new subdirectories (and files) before we
+ * have added its watch. Therefore, we always add the watch first, and
+ * then list the directory. Everything created after the watch exists
+ * produces an event, everything before is found by the listing. If we
+ * see a directory twice, inotify_add_watch() returns the existing wd,
+ * and we skip it.
+ *
+ * Listing a directory opens it, which produces events in the directory
+ * and its parent. So that we do not report our own listings, and that
+ * a rescan of a large tree does not overflow the queue again, we first
+ * watch a directory only for the events that we need to follow the
+ * tree. Once the scan is done, we extend the watches to the full mask.
+ * For the same reason, we narrow the mask of the parent while we scan
+ * a new subdirectory. This is a trade-off: inotify cannot tell our own
+ * opens from those of other processes. Thus, while a directory is at
+ * the reduced mask, we miss the open, access, and close events (and
+ * modifications, if they are in the mask) that other processes cause
+ * in it, and nothing reports this gap.
+ *
+ * inotify has no call to change the mask of a wd; we can only add the
+ * watch again by path. If a directory was renamed (or replaced) in the
+ * meantime, the path leads to a different directory, and the kernel
+ * returns its wd. If that wd is not one of ours, we remove it again.
+ * The renamed directory stays at the reduced mask until the rename
+ * event for it arrives: Following the rename, we add the watch again,
+ * and restore the full mask of a directory that we already know.
+ *
+ * If the event queue of the kernel overflows (IN_Q_OVERFLOW), we have
+ * lost events and rescan the whole tree. Afterwards, we remove all
+ * watches that the rescan did not visit.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+struct watch {
+    int wd;                     // 0: free slot
+    int parent;                 // wd of the parent directory, 0 for the root
+    unsigned gen;               // the last scan that has seen this directory
+    char *name;                 // name in the parent, or the root path
+};
+
+struct watch_tree {
+    int fd;                     // the inotify instance
+    uint32_t mask;              // events for every directory
+    int root;                   // wd of the root directory
+
+    struct watch *slots;        // hash map: wd -> watch
+    size_t capacity;            // power of two
+    size_t count;
+
+    unsigned gen;               // incremented for each full rescan
+    bool report;                // print what the listing finds
+    int *queue;                 // directories of the current scan
+    size_t scanned, queued, queue_capacity;
+
+    int moved_to;               // the last directory that moved within the tree
+    bool warned;                // about the watch limit
+};
+
+// The events that we need to follow the tree, and the ones that show
+// how it changes
+#define WATCH_TREE_EVENTS (IN_CREATE | IN_MOVED_TO | IN_MOVE_SELF | IN_DELETE_SELF | \
+                           IN_MOVED_FROM | IN_DELETE)
+
+static size_t watch_hash(struct watch_tree *t, int wd) {
+    return ((uint32_t) wd * 2654435761U) & (t->capacity - 1);
+}
+
+struct watch *watch_find(struct watch_tree *t, int wd) {
+    if (wd <= 0)
+        return NULL;
+    for (size_t i = watch_hash(t, wd); t->slots[i].wd; i = (i + 1) & (t->capacity - 1)) {
+        if (t->slots[i].wd == wd)
+            return &t->slots[i];
+    }
+    return NULL;
+}
+
+static int watch_grow(struct watch_tree *t) {
+    struct watch *old = t->slots;
+    size_t old_capacity = t->capacity;
+
+    t->capacity = old_capacity ? 2 * old_capacity : 1024;
+    t->slots = calloc(t->capacity, sizeof(*t->slots));
+    if (!t->slots) {
+        t->slots = old;
+        t->capacity = old_capacity;
+        return -1;
+    }
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (!old[i].wd)
+            continue;
+        size_t j = watch_hash(t, old[i].wd);
+        while (t->slots[j].wd)
+            j = (j + 1) & (t->capacity - 1);
+        t->slots[j] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+static struct watch *watch_insert(struct watch_tree *t, int wd, int parent, const char *name) {
+    // We keep the load factor below 1/2, such that probe chains stay short
+    if (2 * (t->count + 1) > t->capacity && watch_grow(t) < 0)
+        return NULL;
+
+    char *copy = strdup(name);
+    if (!copy)
+        return NULL;
+
+    size_t i = watch_hash(t, wd);
+    while (t->slots[i].wd)
+        i = (i + 1) & (t->capacity - 1);
+    t->slots[i] = (struct watch) { wd, parent, t->gen, copy };
+    t->count++;
+    return &t->slots[i];
+}
+
+// Forget the watch. We close the gap in the probe chain by moving the
+// following entries back, if their home slot allows it.
+void watch_remove(struct watch_tree *t, int wd) {
+    struct watch *w = watch_find(t, wd);
+    if (!w)
+        return;
+    free(w->name);
+    t->count--;
+
+    size_t mask = t->capacity - 1;
+    size_t hole = w - t->slots;
+    for (size_t i = (hole + 1) & mask; t->slots[i].wd; i = (i + 1) & mask) {
+        size_t home = watch_hash(t, t->slots[i].wd);
+        // Can the entry at i move to the hole? Only if its home slot
+        // is not in the (cyclic) range (hole, i].
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    t->slots[hole].wd = 0;
+    t->slots[hole].name = NULL;
+}
+
+/* Write the path of the directory with the given wd into buf. Returns
+   its length, or -1 if the wd is unknown or the path is too long. */
+int watch_path(struct watch_tree *t, int wd, char *buf, size_t size) {
+    // We collect the components from the leaf to the root, and then
+    // copy them in reverse order.
+    const char *names[PATH_MAX / 2];
+    size_t depth = 0, len = 0;
+
+    for (struct watch *w = watch_find(t, wd); w; w = watch_find(t, w->parent)) {
+        if (depth == ARRAY_SIZE(names))
+            return -1;
+        names[depth++] = w->name;
+        len += strlen(w->name) + 1;
+        if (!w->parent)
+            break;
+    }
+    if (depth == 0 || len > size)
+        return -1;
+
+    char *p = buf;
+    while (depth-- > 0) {
+        size_t n = strlen(names[depth]);
+        memcpy(p, names[depth], n);
+        p += n;
+        *p++ = '/';
+    }
+    p[-1] = '\0';
+    return p - 1 - buf;
+}
+
+static void watch_enqueue(struct watch_tree *t, int wd) {
+    if (t->queued == t->queue_capacity) {
+        size_t capacity = t->queue_capacity ? 2 * t->queue_capacity : 256;
+        int *queue = realloc(t->queue, capacity * sizeof(*queue));
+        if (!queue) {
+            perror("realloc");
+            return;
+        }
+        t->queue = queue;
+        t->queue_capacity = capacity;
+    }
+    t->queue[t->queued++] = wd;
+}
+
+/* Change the mask of the watch wd, which we find by its path. If the
+   path leads to a different directory by now, we do not want to watch
+   it, unless it is in our tree anyway. Like watch_tree_init(), we
+   follow a symlink only for the root. */
+static void watch_set_mask(struct watch_tree *t, int wd, const char *path, uint32_t mask) {
+    mask |= IN_ONLYDIR | (wd == t->root ? 0 : IN_DONT_FOLLOW);
+    int ret = inotify_add_watch(t->fd, path, mask);
+    if (ret >= 0 && ret != wd && !watch_find(t, ret))
+        inotify_rm_watch(t->fd, ret);
+}
+
+/* Watch the directory name in the directory parent, and list it later
+   if it is new (or not yet seen by the current rescan). Returns its
+   wd, or -1 if it is gone, is no directory, or we hit the limit. */
+static int watch_add(struct watch_tree *t, int parent, const char *name) {
+    char path[PATH_MAX];
+    int len = watch_path(t, parent, path, sizeof(path));
+    if (len < 0 || (size_t) len + 1 + strlen(name) + 1 > sizeof(path))
+        return -1;
+    path[len] = '/';
+    strcpy(path + len + 1, name);
+
+    int wd = inotify_add_watch(t->fd, path, WATCH_TREE_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        if (errno == ENOSPC && !t->warned) {
+            fprintf(stderr, "%s: out of inotify watches; "
+                    "raise /proc/sys/fs/inotify/max_user_watches\n", path);
+            t->warned = true;
+        }
+        return -1;
+    }
+
+    struct watch *w = watch_find(t, wd);
+    if (w) {
+        // We already watch it. It might have been renamed, though.
+        if (w->parent != parent || strcmp(w->name, name)) {
+            char *copy = strdup(name);
+            if (copy) {
+                free(w->name);
+                w->name = copy;
+                w->parent = parent;
+            }
+        }
+        if (w->gen == t->gen) {
+            // Already listed. Adding it again has reduced its mask;
+            // restore it, unless the current scan does that anyway.
+            bool pending = false;
+            for (size_t i = 0; i < t->queued && !pending; i++)
+                pending = t->queue[i] == wd;
+            if (!pending)
+                watch_set_mask(t, wd, path, t->mask);
+            return wd;
+        }
+        w->gen = t->gen;
+    } else if (!watch_insert(t, wd, parent, name)) {
+        perror("watch_insert");
+        inotify_rm_watch(t->fd, wd);
+        return -1;
+    }
+
+    watch_enqueue(t, wd);
+    return wd;
+}
+
+/* List all queued directories, and watch their subdirectories. As we
+   list them in the order of the queue, parents come before their
+   children, and are still at the reduced mask while we open them. */
+static void watch_scan(struct watch_tree *t) {
+    char path[PATH_MAX];
+
+    for (; t->scanned < t->queued; t->scanned++) {
+        int wd = t->queue[t->scanned];
+        if (watch_path(t, wd, path, sizeof(path)) < 0)
+            continue;
+        DIR *dir = opendir(path);
+        if (!dir)
+            continue;           // already gone again
+
+        struct dirent *d;
+        while ((d = readdir(dir))) {
+            if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+                continue;
+            if (t->report)
+                printf("%s/%s: [scan]\n", path, d->d_name);
+
+            bool isdir = d->d_type == DT_DIR;
+            if (d->d_type == DT_UNKNOWN) {
+                struct stat st;
+                isdir = fstatat(dirfd(dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                    && S_ISDIR(st.st_mode);
+            }
+            if (isdir)
+                watch_add(t, wd, d->d_name);
+        }
+        closedir(dir);
+    }
+
+    // Now, extend the watches to all events
+    for (size_t i = 0; i < t->queued; i++) {
+        if (watch_path(t, t->queue[i], path, sizeof(path)) >= 0)
+            watch_set_mask(t, t->queue[i], path, t->mask);
+    }
+    t->scanned = t->queued = 0;
+}
+
+/* Rescan the whole tree after we lost events. Directories that the
+   rescan does not reach anymore lose their watch. */
+static void watch_rescan(struct watch_tree *t) {
+    char path[PATH_MAX];
+    t->gen++;
+    struct watch *root = watch_find(t, t->root);
+    if (root && watch_path(t, t->root, path, sizeof(path)) >= 0) {
+        root->gen = t->gen;
+        watch_set_mask(t, t->root, path, WATCH_TREE_EVENTS);
+        watch_enqueue(t, t->root);
+    }
+
+    // The listing would repeat all directory entries that we know
+    t->report = false;
+    watch_scan(t);
+    t->report = true;
+
+    size_t stale = 0;
+    int *wds = malloc(t->count * sizeof(*wds) + 1);
+    for (size_t i = 0; wds && i < t->capacity; i++) {
+        if (t->slots[i].wd && t->slots[i].gen != t->gen)
+            wds[stale++] = t->slots[i].wd;
+    }
+    for (size_t i = 0; i < stale; i++) {
+        inotify_rm_watch(t->fd, wds[i]);
+        watch_remove(t, wds[i]);
+    }
+    free(wds);
+}
+
+// Is the directory with wd below (or equal to) the one with ancestor?
+static bool watch_below(struct watch_tree *t, int wd, int ancestor) {
+    // As in watch_path(), we bound the depth against broken chains
+    int depth = 0;
+    for (struct watch *w = watch_find(t, wd); w && depth < PATH_MAX / 2;
+         w = watch_find(t, w->parent), depth++) {
+        if (w->wd == ancestor)
+            return true;
+    }
+    return false;
+}
+
+// Stop watching a subtree that has left our tree
+static void watch_prune(struct watch_tree *t, int top) {
+    size_t n = 0;
+    int *wds = malloc(t->count * sizeof(*wds) + 1);
+    for (size_t i = 0; wds && i < t->capacity; i++) {
+        if (t->slots[i].wd && watch_below(t, t->slots[i].wd, top))
+            wds[n++] = t->slots[i].wd;
+    }
+    for (size_t i = 0; i < n; i++) {
+        inotify_rm_watch(t->fd, wds[i]);
+        watch_remove(t, wds[i]);
+    }
+    free(wds);
+}
+
+/* Watch the tree below path for the events in mask. Returns 0 on
+   success; the caller reads the events from t->fd and passes them to
+   watch_event(). */
+int watch_tree_init(struct watch_tree *t, const char *path, uint32_t mask) {
+    memset(t, 0, sizeof(*t));
+    t->mask = mask | WATCH_TREE_EVENTS;
+    if ((t->fd = inotify_init()) < 0)
+        return -1;
+
+    t->root = inotify_add_watch(t->fd, path, WATCH_TREE_EVENTS | IN_ONLYDIR);
+    if (t->root < 0 || !watch_insert(t, t->root, 0, path)) {
+        close(t->fd);
+        return -1;
+    }
+    watch_enqueue(t, t->root);
+    watch_scan(t);
+    t->report = true;
+    return 0;
+}
+
+void watch_tree_free(struct watch_tree *t) {
+    for (size_t i = 0; i < t->capacity; i++)
+        free(t->slots[i].name);
+    free(t->slots);
+    free(t->queue);
+    close(t->fd);
+}
+
+/* Update the tree for one event. Call it after you have used the event,
+   as it might remove the watch that the event refers to. Returns false
+   once the root directory is gone. */
+bool watch_event(struct watch_tree *t, const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        watch_rescan(t);
+    } else if (ev->mask & IN_IGNORED) {
+        // The directory is gone, or we removed the watch
+        watch_remove(t, ev->wd);
+    } else if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+        // Listing the new directory would show up in its parent, too
+        char parent[PATH_MAX];
+        bool quiet = watch_path(t, ev->wd, parent, sizeof(parent)) >= 0;
+        if (quiet)
+            watch_set_mask(t, ev->wd, parent, WATCH_TREE_EVENTS);
+
+        int wd = watch_add(t, ev->wd, ev->name);
+        if (ev->mask & IN_MOVED_TO)
+            t->moved_to = wd;
+        watch_scan(t);
+
+        if (quiet)
+            watch_set_mask(t, ev->wd, parent, t->mask);
+    } else if ((ev->mask & IN_MOVE_SELF) && ev->wd != t->root) {
+        // The kernel reports IN_MOVED_TO to the new parent before
+        // IN_MOVE_SELF. If there was none, it has left our tree.
+        if (ev->wd != t->moved_to)
+            watch_prune(t, ev->wd);
+        t->moved_to = 0;
+    }
+    return watch_find(t, t->root) != NULL;
+}
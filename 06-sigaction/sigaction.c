@@ -15,29 +15,13 @@ unsigned long PAGE_SIZE;
 
 extern int main(void);
 
-/* See Day 2: clone.
+/* See Day 2: clone. syscall_printf() is async-signal safe and can be
+ * used from our signal handlers.
  *
- * Example: syscall_write("foobar = ", 23);
+ * Example: syscall_printf(1, "foobar = %d\n", 23);
  */
-int syscall_write(char *msg, int64_t number, char base) {
-    write(1, msg, strlen(msg));
-
-    char buffer[sizeof(number) * 8];
-    char *p = &buffer[sizeof(number) * 8];
-    int len = 1;
-    *(--p) = '\n';
-    if (number < 0) {
-        write(1, "-", 1);
-        number *= -1;
-    }
-    do {
-        *(--p) =  "0123456789ABCDEF"[number % base];
-        number /= base;
-        len ++;
-    } while (number != 0);
-    write(1, p, len);
-    return 0;
-}
+#include "../lib/syscall_printf.c"
+#include "../lib/smaps.c"
 
 /* We have three different fault handlers to make our program
  * nearly "immortal":
@@ -59,7 +43,7 @@ void sa_sigint(int signo, siginfo_t *siginfo, void *ucontext) {
 void sa_sigsegv(int signo, siginfo_t *siginfo, void *ucontext) {
     (void) signo; (void) ucontext;
 
-    syscall_write("SIGSEGV at 0x", (int64_t) siginfo->si_addr, 16);
+    syscall_printf(1, "SIGSEGV at %p\n", siginfo->si_addr);
 
     unsigned long addr = (unsigned long) siginfo->si_addr & ~(PAGE_SIZE-1);
 
@@ -74,13 +58,13 @@ void sa_sigill(int signo, siginfo_t *siginfo, void *ucontext) {
     (void) signo; (void) ucontext;
 
     unsigned long addr = (unsigned long) siginfo->si_addr;
-    syscall_write("SIGILL at 0x", (int64_t) siginfo->si_addr, 16);
+    syscall_printf(1, "SIGILL at %p\n", siginfo->si_addr);
 
     unsigned long i, *frame = __builtin_frame_address(0);
     for (i = 0; *(unsigned long *) frame != addr; i++)
         frame = (unsigned long *) ((char *) frame + 1);
 
-    syscall_write("delta = ", i, 10);
+    syscall_printf(1, "delta = %lu\n", i);
 
     *frame = addr+4;
 }
@@ -108,6 +92,17 @@ int main(void) {
     sigaction(SIGSEGV, &sa_sigsegv_struct, NULL);
     sigaction(SIGILL, &sa_sigill_struct, NULL);
 
+    // With SMAPS=<ms>, we watch our memory grow while we fault
+    struct smaps_watch watch;
+    char *SMAPS = getenv("SMAPS");
+    bool watching = false;
+    if (SMAPS) {
+        if (smaps_watch(&watch, stdout, atoi(SMAPS)) < 0)
+            perror("smaps_watch");
+        else
+            watching = true;
+    }
+
     // We generate an invalid pointer that points _somewhere_! This is
     // undefined behavior, and we only hope for the best here. Perhaps
     // we should install a signal handler for SIGSEGV beforehand....
@@ -131,13 +126,13 @@ int main(void) {
         INVALID_OPCODE_32_BIT();
     }
 
-    { // Like in the mmap exercise, we use pmap to show our own memory
-      // map, before exiting.
-        char cmd[256];
-        snprintf(cmd, 256, "pmap %d", getpid());
-        printf("---- system(\"%s\"):\n", cmd);
-        system(cmd);
-    }
+    if (watching)
+        smaps_unwatch(&watch);
+
+    // Like in the mmap exercise, we show our own memory map, before
+    // exiting.
+    printf("---- /proc/self/smaps:\n");
+    smaps_print(stdout);
 
     return 0;
 }
@@ -0,0 +1,91 @@
+/* Hardware and software event counters with perf_event_open().
+ *
+ * For each measured round, we count CPU cycles, retired instructions,
+ * page faults, and context switches. With inherit=1, the counters
+ * also include threads that the copy implementation spawns.
+ *
+ * Whether we may count, depends on /proc/sys/kernel/perf_event_paranoid.
+ * If we are not allowed to count kernel events, we retry with
+ * user-space events only. If a counter does not exist at all (e.g.,
+ * hardware counters in many virtual machines), it reports "n/a". */
+#include <linux/perf_event.h>
+
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_FAULTS, PERF_CSWITCHES, PERF_COUNTERS };
+
+static const struct {
+    char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_COUNTERS] = {
+    [PERF_CYCLES]       = { "cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [PERF_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [PERF_FAULTS]       = { "page_faults",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    [PERF_CSWITCHES]    = { "ctx_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+// -1 for counters that are not available
+static int perf_fd[PERF_COUNTERS];
+
+// Did we have to fall back to user-space only counting?
+static bool perf_user_only;
+
+static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+                           int group_fd, unsigned long flags) {
+    return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static int perf_open_one(int i, bool user_only) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = perf_events[i].type;
+    attr.config         = perf_events[i].config;
+    attr.inherit        = 1;
+    attr.exclude_hv     = 1;
+    attr.exclude_kernel = user_only;
+
+    return perf_event_open(&attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+void perf_init(void) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        perf_fd[i] = perf_open_one(i, perf_user_only);
+        if (perf_fd[i] < 0 && (errno == EACCES || errno == EPERM) && !perf_user_only) {
+            // Not allowed to count kernel events. Start over with
+            // user-space events for all counters, such that they
+            // stay comparable to each other.
+            for (int j = 0; j < i; j++)
+                if (perf_fd[j] >= 0)
+                    close(perf_fd[j]);
+            perf_user_only = true;
+            i = -1;
+        }
+    }
+}
+
+// Counter values at perf_start()
+static int64_t perf_base[PERF_COUNTERS];
+
+static int64_t perf_read(int i) {
+    uint64_t value;
+    if (perf_fd[i] < 0 || read(perf_fd[i], &value, sizeof(value)) != sizeof(value))
+        return -1;
+    return value;
+}
+
+// The counters run all the time. We do not reset them between rounds,
+// as PERF_EVENT_IOC_RESET does not reset the counts that exited child
+// threads have passed on to us (inherit=1). Instead, each round
+// reports the difference between two readings.
+void perf_start(void) {
+    for (int i = 0; i < PERF_COUNTERS; i++)
+        perf_base[i] = perf_read(i);
+}
+
+// Read the counters. Unavailable counters are set to -1.
+void perf_stop(int64_t counters[PERF_COUNTERS]) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        int64_t value = perf_read(i);
+        counters[i] = (value < 0 || perf_base[i] < 0) ? -1 : value - perf_base[i];
+    }
+}
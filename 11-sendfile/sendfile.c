@@ -15,27 +15,67 @@
 #include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <math.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #ifndef BUFFER_SIZE
 #define BUFFER_SIZE 128 /*KiB*/ *1024
 #endif
 
+// Bounds for the chunk-size sweep (CHUNK=sweep)
+#define CHUNK_MIN   4 /*KiB*/ *1024
+#define CHUNK_MAX  16 /*MiB*/ *1024*1024
+
+#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(*(arr)))
 #define die(msg) do { perror(msg); exit(EXIT_FAILURE); } while(0)
 
+#include "../lib/parse_size.c"
+#include "uring.c"
+#include "perf.c"
+
+// The number of bytes that each copy implementation moves per system
+// call. Set by main() for each step of the chunk-size sweep.
+static size_t chunk = BUFFER_SIZE;
+
+// The number of threads for the parallel copy implementations. Set by
+// main() for each step of the thread sweep.
+static int nthreads = 1;
+
+// Benchmark modes (see main()):
+//   cold:   evict the input file from the page cache before each round
+//   sync:   how the output reaches stable storage within the timing
+static bool cold;
+static enum { SYNC_NONE, SYNC_FDATASYNC, SYNC_DSYNC } sync_mode;
+
+// A user-space buffer that is large enough for two chunks of the
+// largest size in the sweep.
+static char *buffer;
+
+// Copy implementations return the number of copied bytes. If the
+// kernel or the file system does not support an implementation for
+// the given file descriptors, it returns -1 with errno set. All other
+// errors are fatal.
+static bool unsupported(int err) {
+    return err == EINVAL || err == EXDEV || err == ENOSYS ||
+        err == EOPNOTSUPP || err == EPERM;
+}
+
 ssize_t copy_write(int fd_in, int fd_out, int *syscalls) {
-    static char buffer[BUFFER_SIZE];
     ssize_t ret = 0;
     *syscalls = 0;
 
     ssize_t bytes;
     while ((bytes = ((*syscalls)++,
-                     read(fd_in, buffer, BUFFER_SIZE))) > 0) {
+                     read(fd_in, buffer, chunk))) > 0) {
         ssize_t acc = 0;
 
         while (acc < bytes) {
             (*syscalls)++;
-            ssize_t nwritten = write(fd_out, buffer, BUFFER_SIZE);
+            ssize_t nwritten = write(fd_out, buffer + acc, bytes - acc);
             if (nwritten < 0)
                 die("write");
 
@@ -59,7 +99,7 @@ ssize_t copy_sendfile(int fd_in, int fd_out, int *syscalls) {
     do {
         (*syscalls)++;
         ret += bytes;
-    } while ((bytes = sendfile(fd_out, fd_in, NULL, BUFFER_SIZE)) > 0);
+    } while ((bytes = sendfile(fd_out, fd_in, NULL, chunk)) > 0);
 
     if (bytes < 0)
         die("sendfile");
@@ -67,22 +107,403 @@ ssize_t copy_sendfile(int fd_in, int fd_out, int *syscalls) {
     return ret;
 }
 
+// splice() moves pages between a file and a pipe without copying
+// them. Therefore, we need an intermediate pipe to get from one file
+// to another one: fd_in -> pipe -> fd_out.
+static void pipe_open(int pipefd[2], int *syscalls) {
+    (*syscalls)++;
+    if (pipe(pipefd) < 0) die("pipe");
+
+    // The pipe capacity limits how much a single splice() can move.
+    // Unprivileged users may not grow it beyond
+    // /proc/sys/fs/pipe-max-size; then, we stay with the default.
+    (*syscalls)++;
+    fcntl(pipefd[1], F_SETPIPE_SZ, chunk);
+}
+
+static void pipe_close(int pipefd[2], int *syscalls) {
+    (*syscalls) += 2;
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+// Move exactly `bytes` from the pipe to fd_out
+static void pipe_drain(int pipefd[2], int fd_out, ssize_t bytes, int *syscalls) {
+    while (bytes > 0) {
+        (*syscalls)++;
+        ssize_t n = splice(pipefd[0], NULL, fd_out, NULL, bytes, SPLICE_F_MOVE);
+        if (n < 0) die("splice");
+        bytes -= n;
+    }
+}
+
+ssize_t copy_splice(int fd_in, int fd_out, int *syscalls) {
+    ssize_t ret = 0;
+    *syscalls = 0;
+
+    int pipefd[2];
+    pipe_open(pipefd, syscalls);
+
+    ssize_t bytes;
+    while ((bytes = ((*syscalls)++,
+                     splice(fd_in, NULL, pipefd[1], NULL, chunk,
+                            SPLICE_F_MOVE))) > 0) {
+        pipe_drain(pipefd, fd_out, bytes, syscalls);
+        ret += bytes;
+    }
+
+    if (bytes < 0)
+        die("splice");
+
+    pipe_close(pipefd, syscalls);
+    return ret;
+}
+
+// copy_file_range() copies between two files within the kernel. Some
+// file systems can even share the data blocks (reflink).
+ssize_t copy_range(int fd_in, int fd_out, int *syscalls) {
+    ssize_t ret = 0;
+    *syscalls = 0;
+
+    ssize_t bytes = 0;
+    do {
+        (*syscalls)++;
+        ret += bytes;
+    } while ((bytes = copy_file_range(fd_in, NULL, fd_out, NULL, chunk, 0)) > 0);
+
+    if (bytes < 0) {
+        if (ret == 0 && unsupported(errno))
+            return -1;
+        die("copy_file_range");
+    }
+
+    return ret;
+}
+
+// We map the whole input file and write() it from the mapping. This
+// saves the copy into our buffer, but every page has to be faulted
+// in.
+ssize_t copy_mmap(int fd_in, int fd_out, int *syscalls) {
+    ssize_t ret = 0;
+    *syscalls = 0;
+
+    struct stat st;
+    (*syscalls)++;
+    if (fstat(fd_in, &st) < 0) die("fstat");
+    if (st.st_size == 0)
+        return 0;
+
+    (*syscalls) += 2;
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd_in, 0);
+    if (map == MAP_FAILED) die("mmap");
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    while (ret < st.st_size) {
+        size_t len = st.st_size - ret;
+        if (len > chunk)
+            len = chunk;
+
+        (*syscalls)++;
+        ssize_t nwritten = write(fd_out, map + ret, len);
+        if (nwritten < 0)
+            die("write");
+        ret += nwritten;
+    }
+
+    (*syscalls)++;
+    munmap(map, st.st_size);
+
+    return ret;
+}
+
+// vmsplice() maps our user-space buffer into a pipe. From there,
+// splice() moves it to the output file: fd_in -> buffer -> pipe -> fd_out.
+// As the pipe references our buffer, we must drain it before the next
+// read() overwrites the buffer.
+ssize_t copy_vmsplice(int fd_in, int fd_out, int *syscalls) {
+    ssize_t ret = 0;
+    *syscalls = 0;
+
+    int pipefd[2];
+    pipe_open(pipefd, syscalls);
+
+    ssize_t bytes;
+    while ((bytes = ((*syscalls)++,
+                     read(fd_in, buffer, chunk))) > 0) {
+        struct iovec iov = { .iov_base = buffer, .iov_len = bytes };
+
+        while (iov.iov_len > 0) {
+            (*syscalls)++;
+            ssize_t n = vmsplice(pipefd[1], &iov, 1, 0);
+            if (n < 0) die("vmsplice");
+
+            pipe_drain(pipefd, fd_out, n, syscalls);
+            iov.iov_base = (char *) iov.iov_base + n;
+            iov.iov_len -= n;
+        }
+
+        ret += bytes;
+    }
+
+    if (bytes < 0)
+        die("read");
+
+    pipe_close(pipefd, syscalls);
+    return ret;
+}
+
+// With io_uring, we use two buffer halves: With one io_uring_enter(),
+// we submit the write of chunk i together with the read of chunk i+1
+// and wait for both. Thereby, reads and writes overlap.
+ssize_t copy_uring(int fd_in, int fd_out, int *syscalls) {
+    ssize_t ret = 0;
+    *syscalls = 0;
+
+    struct uring r;
+    (*syscalls)++;
+    if (uring_init(&r, 4) < 0)
+        return -1;
+    (*syscalls) += 3;           // mmap() of the rings
+
+    off_t roff = lseek(fd_in, 0, SEEK_CUR);
+    char *bufs[2] = { buffer, buffer + CHUNK_MAX };
+    int cur = 0;
+    struct io_uring_cqe cqe;
+
+    // Read the first chunk
+    uring_prep_rw(&r, IORING_OP_READ, fd_in, bufs[cur], chunk, roff, 0);
+    (*syscalls)++;
+    uring_enter(&r, 1);
+    if (!uring_reap(&r, &cqe)) die("uring_reap");
+    ssize_t bytes = cqe.res;
+
+    while (bytes > 0) {
+        roff += bytes;
+        uring_prep_rw(&r, IORING_OP_WRITE, fd_out, bufs[cur], bytes, ret, 1);
+        uring_prep_rw(&r, IORING_OP_READ, fd_in, bufs[!cur], chunk, roff, 0);
+        (*syscalls)++;
+        uring_enter(&r, 2);
+
+        ssize_t next = 0;
+        for (int i = 0; i < 2; i++) {
+            if (!uring_reap(&r, &cqe)) die("uring_reap");
+            if (cqe.user_data == 1 && cqe.res != bytes) {
+                errno = cqe.res < 0 ? -cqe.res : EIO;
+                die("io_uring write");
+            }
+            if (cqe.user_data == 0)
+                next = cqe.res;
+        }
+
+        ret += bytes;
+        bytes = next;
+        cur = !cur;
+    }
+
+    if (bytes < 0) {
+        errno = -bytes;
+        die("io_uring read");
+    }
+
+    (*syscalls) += 4;
+    uring_exit(&r);
+
+    return ret;
+}
+
+// The parallel copy implementations split the input file into
+// nthreads ranges of equal size and copy them concurrently, each range
+// in its own thread. As all threads share the file descriptors, they
+// must not use the shared file offsets but explicit positions.
+struct range {
+    int fd_in, fd_out;
+    off_t start, end;           // [start, end) of the input file
+    bool use_sendfile;
+    ssize_t bytes;
+    int syscalls;
+};
+
+static void *copy_range_thread(void *arg) {
+    struct range *r = arg;
+    off_t off = r->start;
+
+    if (r->use_sendfile) {
+        // sendfile() takes an explicit input offset, but it always
+        // writes at the file offset of fd_out. Therefore, each
+        // thread opens its own file description of the output file
+        // and seeks to the start of its range.
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", r->fd_out);
+        r->syscalls += 2;
+        int flags = fcntl(r->fd_out, F_GETFL);
+        int fd_out = open(path, O_WRONLY | (flags & O_DSYNC));
+        if (fd_out < 0) die("open");
+        if (lseek(fd_out, r->start, SEEK_SET) < 0) die("lseek");
+
+        while (off < r->end) {
+            size_t len = r->end - off < (off_t) chunk ? (size_t) (r->end - off) : chunk;
+            r->syscalls++;
+            ssize_t n = sendfile(fd_out, r->fd_in, &off, len);
+            if (n < 0) die("sendfile");
+            if (n == 0) break;  // file was truncated behind our back
+            r->bytes += n;
+        }
+
+        r->syscalls++;
+        close(fd_out);
+        return NULL;
+    }
+
+    char *buf = malloc(chunk);
+    if (!buf) die("malloc");
+
+    while (off < r->end) {
+        size_t len = r->end - off < (off_t) chunk ? (size_t) (r->end - off) : chunk;
+        r->syscalls++;
+        ssize_t n = pread(r->fd_in, buf, len, off);
+        if (n < 0) die("pread");
+        if (n == 0) break;
+
+        for (ssize_t acc = 0; acc < n; ) {
+            r->syscalls++;
+            ssize_t nwritten = pwrite(r->fd_out, buf + acc, n - acc, off + acc);
+            if (nwritten < 0) die("pwrite");
+            acc += nwritten;
+        }
+
+        off += n;
+        r->bytes += n;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static ssize_t copy_parallel(int fd_in, int fd_out, int *syscalls, bool use_sendfile) {
+    ssize_t ret = 0;
+    *syscalls = 0;
+
+    struct stat st;
+    (*syscalls)++;
+    if (fstat(fd_in, &st) < 0) die("fstat");
+
+    // We round the ranges up to whole pages, such that no two threads
+    // touch the same page of the page cache.
+    off_t per_thread = (st.st_size + nthreads - 1) / nthreads;
+    per_thread = (per_thread + 4095) & ~(off_t) 4095;
+
+    struct range ranges[nthreads];
+    pthread_t threads[nthreads];
+    for (int t = 0; t < nthreads; t++) {
+        off_t start = t * per_thread;
+        ranges[t] = (struct range) {
+            .fd_in = fd_in, .fd_out = fd_out,
+            .start = start < st.st_size ? start : st.st_size,
+            .end   = start + per_thread < st.st_size ? start + per_thread : st.st_size,
+            .use_sendfile = use_sendfile,
+        };
+
+        (*syscalls)++;          // clone()
+        int err = pthread_create(&threads[t], NULL, copy_range_thread, &ranges[t]);
+        if (err) { errno = err; die("pthread_create"); }
+    }
+
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+        ret += ranges[t].bytes;
+        *syscalls += ranges[t].syscalls;
+    }
+
+    return ret;
+}
+
+ssize_t copy_parallel_pwrite(int fd_in, int fd_out, int *syscalls) {
+    return copy_parallel(fd_in, fd_out, syscalls, false);
+}
+
+ssize_t copy_parallel_sendfile(int fd_in, int fd_out, int *syscalls) {
+    return copy_parallel(fd_in, fd_out, syscalls, true);
+}
+
+#include "socket.c"
+
+// All copy implementations share the same interface. The
+// ENGINES environment variable selects a subset of them (e.g.
+// ENGINES=sendfile,splice). Parallel engines are measured for every
+// thread count of the THREADS sweep.
+struct engine {
+    char *name;
+    ssize_t (*copy)(int fd_in, int fd_out, int *syscalls);
+    bool parallel;              // uses nthreads threads
+    bool disabled;              // not selected by ENGINES
+    bool unsupported;           // a measurement failed
+} engines[] = {
+    { "sendfile",     copy_sendfile,          false, false, false },
+    { "read/write",   copy_write,             false, false, false },
+    { "splice",       copy_splice,            false, false, false },
+    { "copy_range",   copy_range,             false, false, false },
+    { "mmap/write",   copy_mmap,              false, false, false },
+    { "vmsplice",     copy_vmsplice,          false, false, false },
+    { "io_uring",     copy_uring,             false, false, false },
+    { "par/pwrite",   copy_parallel_pwrite,   true,  false, false },
+    { "par/sendfile", copy_parallel_sendfile, true,  false, false },
+    // file -> socket
+    { "unix/sendfile", copy_unix_sendfile,    false, false, false },
+    { "tcp/sendfile",  copy_tcp_sendfile,     false, false, false },
+    { "unix/write",    copy_unix_write,       false, false, false },
+    { "tcp/write",     copy_tcp_write,        false, false, false },
+    { "tcp/zerocopy",  copy_tcp_zerocopy,     false, false, false },
+    // socket -> file
+    { "unix/splice",   copy_unix_splice,      false, false, false },
+    { "tcp/splice",    copy_tcp_splice,       false, false, false },
+    { "unix/read",     copy_unix_read,        false, false, false },
+    { "tcp/read",      copy_tcp_read,         false, false, false },
+};
+
+// The outcome of a single measurement round
+struct sample {
+    ssize_t bytes;
+    double  seconds;            // wall-clock time
+    double  utime, stime;       // CPU time in user and kernel space
+    int     syscalls;
+    int64_t counters[PERF_COUNTERS];
+};
+
+static double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
 // This function measures the given copy implementation.
 // fd_in:  file descriptor to copy from
 // fd_out: file descriptor to copy to
 // banner: Just a nice string to print the output
 // copy:   The copy implementation
-// returns the number of bytes per second
-double measure(int fd_in, int fd_out, char *banner, ssize_t (*copy)(int, int, int*)) {
+// verbose: print a line for this round
+// Fills the given sample and returns 0, or -1 if the copy
+// implementation is not supported.
+int measure(int fd_in, int fd_out, char *banner, ssize_t (*copy)(int, int, int*),
+            bool verbose, struct sample *sample) {
     // First, we reset our file descriptors.
     // fd_in:  seek to position zero
-    // fd_out: truncate the file to zero bytes.
+    // fd_out: truncate the file to zero bytes and seek to its start.
     if (lseek(fd_in, 0, SEEK_SET) < 0) die("lseek");
     if (ftruncate(fd_out, 0) < 0)      die("ftruncate");
+    if (lseek(fd_out, 0, SEEK_SET) < 0) die("lseek");
 
-    // Measure the start time.
+    // In cold mode, we drop the input file from the page cache. Thereby,
+    // every round has to fetch the data from the storage device.
+    if (cold && (errno = posix_fadvise(fd_in, 0, 0, POSIX_FADV_DONTNEED)))
+        die("posix_fadvise");
+
+    // Measure the start time. We use the monotonic clock, as the
+    // real-time clock can jump (e.g., if NTP adjusts it) while we
+    // measure.
     struct timespec start, end;
-    if (clock_gettime(CLOCK_REALTIME, &start) < 0)
+    struct rusage ru_start, ru_end;
+    if (getrusage(RUSAGE_SELF, &ru_start) < 0)
+        die("getrusage");
+    perf_start();
+    if (clock_gettime(CLOCK_MONOTONIC, &start) < 0)
         die("clock_gettime");
 
     // Perform the actual copy. We give the copy function also a
@@ -91,25 +512,174 @@ double measure(int fd_in, int fd_out, char *banner, ssize_t (*copy)(int, int, in
     int syscalls;
     ssize_t bytes = copy(fd_in, fd_out, &syscalls);
 
+    // A copy is only durable once the data has reached the disk. With
+    // O_DSYNC, every write() waits for that; otherwise, we flush the
+    // file once at the end.
+    if (bytes >= 0 && sync_mode == SYNC_FDATASYNC) {
+        syscalls++;
+        if (fdatasync(fd_out) < 0) die("fdatasync");
+    }
 
     // Measure the end time
-    if (clock_gettime(CLOCK_REALTIME, &end) < 0)
+    if (clock_gettime(CLOCK_MONOTONIC, &end) < 0)
         die("clock_gettime");
+    perf_stop(sample->counters);
+    if (getrusage(RUSAGE_SELF, &ru_end) < 0)
+        die("getrusage");
+
+    if (bytes < 0) {
+        fprintf(stderr, "[%12s] not supported: %s\n", banner, strerror(errno));
+        return -1;
+    }
 
     // Calculate the time delta between both points in time.
     double delta = end.tv_sec - start.tv_sec;
     delta += (end.tv_nsec - start.tv_nsec) / 1e9;
 
+    sample->bytes    = bytes;
+    sample->seconds  = delta;
+    sample->syscalls = syscalls;
+    sample->utime    = timeval_seconds(ru_end.ru_utime) - timeval_seconds(ru_start.ru_utime);
+    sample->stime    = timeval_seconds(ru_end.ru_stime) - timeval_seconds(ru_start.ru_stime);
+
     // Print out some nicely formatted message
-    printf("[%10s] copied with %.2f MiB/s (in %.2f s, %d syscalls)\n",
-           banner, (bytes /delta) / 1024.0 / 1024.0, delta, syscalls);
+    if (verbose)
+        printf("[%12s] copied with %.2f MiB/s (in %.2f s, %d syscalls)\n",
+               banner, (bytes /delta) / 1024.0 / 1024.0, delta, syscalls);
 
-    return bytes / delta;
+    return 0;
+}
+
+// Statistics over all rounds of one engine and chunk size. Throughput
+// percentiles are taken over the round times: p95 is the throughput
+// that 95 percent of all rounds achieved or exceeded.
+struct summary {
+    double mean, median, p95, p99, stddev;  // MiB/s
+    double utime, stime;                    // seconds per round
+    double cpu_per_byte;                    // user+sys nanoseconds per byte
+    double counters[PERF_COUNTERS];         // per round, -1 if n/a
+};
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array
+static double percentile(double *sorted, int n, double p) {
+    int rank = ceil(p / 100.0 * n);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void summarize(struct sample *samples, int n, struct summary *s) {
+    double seconds[n], mibs[n];
+    double sum = 0, sqsum = 0;
+
+    memset(s, 0, sizeof(*s));
+    for (int i = 0; i < n; i++) {
+        seconds[i] = samples[i].seconds;
+        mibs[i]    = samples[i].bytes / samples[i].seconds / (1024*1024);
+        sum       += mibs[i];
+        s->utime  += samples[i].utime / n;
+        s->stime  += samples[i].stime / n;
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            if (samples[i].counters[c] < 0 || s->counters[c] < 0)
+                s->counters[c] = -1;
+            else
+                s->counters[c] += (double) samples[i].counters[c] / n;
+        }
+    }
+    s->mean = sum / n;
+    for (int i = 0; i < n; i++)
+        sqsum += (mibs[i] - s->mean) * (mibs[i] - s->mean);
+    s->stddev = n > 1 ? sqrt(sqsum / (n - 1)) : 0;
+    s->cpu_per_byte = samples[0].bytes > 0
+        ? (s->utime + s->stime) * 1e9 / samples[0].bytes : 0;
+
+    // All rounds copy the same number of bytes, so the throughput
+    // follows directly from the round time.
+    double mib = samples[0].bytes / (1024.0*1024);
+    qsort(seconds, n, sizeof(*seconds), compare_double);
+    s->median = mib / percentile(seconds, n, 50);
+    s->p95    = mib / percentile(seconds, n, 95);
+    s->p99    = mib / percentile(seconds, n, 99);
+}
+
+// Format sizes as "4K", "128K", or "16M"
+static char *format_size(size_t size, char *buf, size_t len) {
+    if (size >= 1024*1024 && size % (1024*1024) == 0)
+        snprintf(buf, len, "%zuM", size / (1024*1024));
+    else if (size >= 1024 && size % 1024 == 0)
+        snprintf(buf, len, "%zuK", size / 1024);
+    else
+        snprintf(buf, len, "%zu", size);
+    return buf;
+}
+
+enum format { TEXT, CSV, JSON };
+
+void report(enum format format, bool first, char *engine, size_t chunk,
+            int threads, int rounds, struct summary *s) {
+    char size[24];
+    format_size(chunk, size, sizeof(size));
+
+    switch (format) {
+    case TEXT:
+        printf("%12s %6s x%-3d: median %.2f MiB/s (mean %.2f, p95 %.2f, p99 %.2f, "
+               "stddev %.2f), user %.4f s, sys %.4f s, %.3f ns/byte",
+               engine, size, threads, s->median, s->mean, s->p95, s->p99, s->stddev,
+               s->utime, s->stime, s->cpu_per_byte);
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            if (s->counters[c] < 0)
+                printf(", %s n/a", perf_events[c].name);
+            else
+                printf(", %s %.0f", perf_events[c].name, s->counters[c]);
+        }
+        printf("\n");
+        break;
+    case CSV:
+        printf("%s,%zu,%d,%d,%.2f,%.2f,%.2f,%.2f,%.2f,%.6f,%.6f,%.4f",
+               engine, chunk, threads, rounds, s->mean, s->median, s->p95, s->p99,
+               s->stddev, s->utime, s->stime, s->cpu_per_byte);
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            if (s->counters[c] < 0)
+                printf(",");
+            else
+                printf(",%.0f", s->counters[c]);
+        }
+        printf("\n");
+        break;
+    case JSON:
+        printf("%s  {\"engine\": \"%s\", \"chunk\": %zu, \"threads\": %d, "
+               "\"rounds\": %d, "
+               "\"mean_mib_s\": %.2f, \"median_mib_s\": %.2f, "
+               "\"p95_mib_s\": %.2f, \"p99_mib_s\": %.2f, \"stddev_mib_s\": %.2f, "
+               "\"user_s\": %.6f, \"sys_s\": %.6f, \"cpu_ns_per_byte\": %.4f",
+               first ? "" : ",\n", engine, chunk, threads, rounds, s->mean, s->median,
+               s->p95, s->p99, s->stddev, s->utime, s->stime, s->cpu_per_byte);
+        for (int c = 0; c < PERF_COUNTERS; c++) {
+            if (s->counters[c] < 0)
+                printf(", \"%s\": null", perf_events[c].name);
+            else
+                printf(", \"%s\": %.0f", perf_events[c].name, s->counters[c]);
+        }
+        printf("}");
+        break;
+    }
 }
 
 int main(int argc, char *argv[]) {
     if (argc != 2) {
         fprintf(stderr, "usage: %s FILE\n", argv[0]);
+        fprintf(stderr, "environment:\n");
+        fprintf(stderr, "  ROUNDS=n          rounds per engine and chunk size (10)\n");
+        fprintf(stderr, "  ENGINES=a,b,...   engines to measure (all)\n");
+        fprintf(stderr, "  CHUNK=size|sweep  bytes per system call, or 4K..16M (128K)\n");
+        fprintf(stderr, "  THREADS=n|sweep   threads of the parallel engines, or 1..ncpu (1)\n");
+        fprintf(stderr, "  CACHE=warm|cold    drop the input from the page cache before each round (warm)\n");
+        fprintf(stderr, "  TARGET=path       copy to this file instead of a memfd\n");
+        fprintf(stderr, "  SYNC=none|fdatasync|dsync  make the output durable within the timing (none)\n");
+        fprintf(stderr, "  FORMAT=text|csv|json\n");
         return -1;
     }
     // As input file, we open the user-specified file from the command
@@ -117,31 +687,190 @@ int main(int argc, char *argv[]) {
     int fd_in = open(argv[1], O_RDONLY);
     if (fd_in < 0) die("open");
 
-    // As an output, we create an anonymous in-memory file. By using
-    // such an in-memory file, do not measure the influence of on-disk
-    // file systems.
-    int fd_out = memfd_create("target", 0);
+    char *CACHE = getenv("CACHE");
+    cold = CACHE && !strcmp(CACHE, "cold");
+
+    char *SYNC = getenv("SYNC");
+    if (SYNC && !strcmp(SYNC, "fdatasync")) sync_mode = SYNC_FDATASYNC;
+    if (SYNC && !strcmp(SYNC, "dsync"))     sync_mode = SYNC_DSYNC;
+
+    // As an output, we create an anonymous in-memory file by default.
+    // By using such an in-memory file, do not measure the influence of
+    // on-disk file systems. With TARGET, we write to a real file
+    // instead.
+    char *TARGET = getenv("TARGET");
+    int fd_out;
+    if (TARGET) {
+        fd_out = open(TARGET, O_RDWR | O_CREAT | O_TRUNC |
+                      (sync_mode == SYNC_DSYNC ? O_DSYNC : 0), 0644);
+        if (fd_out < 0) die("open");
+    } else {
+        fd_out = memfd_create("target", 0);
+        if (fd_out < 0) die("memfd_create");
+
+        // O_DSYNC cannot be set with fcntl(). Therefore, we reopen
+        // the memfd with it.
+        if (sync_mode == SYNC_DSYNC) {
+            char path[64];
+            snprintf(path, sizeof(path), "/proc/self/fd/%d", fd_out);
+            int fd = open(path, O_RDWR | O_DSYNC);
+            if (fd < 0) die("open");
+            close(fd_out);
+            fd_out = fd;
+        }
+    }
 
     // We will run for ten rounds, unless the user specified something
     // else in the ROUNDS environment variable.
     char *ROUNDS = getenv("ROUNDS");
     int rounds = atoi(ROUNDS ? ROUNDS : "10");
+    if (rounds < 1) rounds = 1;
+
+    // The chunk sizes that we measure: either a single size, or all
+    // powers of two between CHUNK_MIN and CHUNK_MAX.
+    size_t chunks[32];
+    int nchunks = 0;
+    char *CHUNK = getenv("CHUNK");
+    if (CHUNK && !strcmp(CHUNK, "sweep")) {
+        for (size_t c = CHUNK_MIN; c <= CHUNK_MAX; c *= 2)
+            chunks[nchunks++] = c;
+    } else {
+        size_t chunk = BUFFER_SIZE;
+        if (CHUNK && parse_size(CHUNK, NULL, &chunk) < 0)
+            chunk = 0;                  // rejected below
+        chunks[nchunks++] = chunk;
+        if (chunks[0] == 0 || chunks[0] > CHUNK_MAX) {
+            fprintf(stderr, "CHUNK must be between 1 and %d bytes\n", CHUNK_MAX);
+            return -1;
+        }
+    }
+
+    // The thread counts for the parallel engines: either a single
+    // count, or powers of two up to the number of online CPUs.
+    int threads[32];
+    int nthreadcounts = 0;
+    char *THREADS = getenv("THREADS");
+    if (THREADS && !strcmp(THREADS, "sweep")) {
+        int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int t = 1; t < ncpu && nthreadcounts < 31; t *= 2)
+            threads[nthreadcounts++] = t;
+        threads[nthreadcounts++] = ncpu;
+    } else {
+        threads[nthreadcounts++] = THREADS ? atoi(THREADS) : 1;
+        if (threads[0] < 1) {
+            fprintf(stderr, "THREADS must be at least 1\n");
+            return -1;
+        }
+    }
+
+    char *ENGINES = getenv("ENGINES");
+    if (ENGINES) {
+        for (size_t e = 0; e < ARRAY_SIZE(engines); e++)
+            engines[e].disabled = true;
+        char *list = strdup(ENGINES), *save;
+        if (!list) die("strdup");
+        for (char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+            size_t e;
+            for (e = 0; e < ARRAY_SIZE(engines); e++) {
+                if (!strcmp(tok, engines[e].name))
+                    break;
+            }
+            if (e == ARRAY_SIZE(engines)) {
+                fprintf(stderr, "unknown engine: %s\n", tok);
+                return -1;
+            }
+            engines[e].disabled = false;
+        }
+        free(list);
+    }
+
+    char *FORMAT = getenv("FORMAT");
+    enum format format = TEXT;
+    if (FORMAT && !strcmp(FORMAT, "csv"))  format = CSV;
+    if (FORMAT && !strcmp(FORMAT, "json")) format = JSON;
+
+    buffer = aligned_alloc(4096, 2 * CHUNK_MAX);
+    if (!buffer) die("aligned_alloc");
+
+    perf_init();
+    if (perf_user_only)
+        fprintf(stderr, "perf: counting user-space events only "
+                "(see /proc/sys/kernel/perf_event_paranoid)\n");
 
     // We run the copy_write algorithm once to warm up the buffer
     // cache. With this, the input file should now, if small enough,
-    // reside in in the buffer cache.
-    int dummy;
-    copy_write(fd_in, fd_out, &dummy);
+    // reside in in the buffer cache. In cold mode, measure() evicts it
+    // anyway.
+    if (!cold) {
+        int dummy;
+        copy_write(fd_in, fd_out, &dummy);
+    }
+
+    // samples[c][t][e][i]: round i of engine e with chunk size c and
+    // thread count t. Serial engines only use t=0.
+    const int nengines = ARRAY_SIZE(engines);
+    struct sample *samples = calloc(nchunks * nthreadcounts * nengines * rounds,
+                                    sizeof(*samples));
+    if (!samples) die("calloc");
+#define SAMPLES(c, t, e) (&samples[(((c) * nthreadcounts + (t)) * nengines + (e)) * rounds])
+    // Number of successful rounds. An engine that fails is not measured
+    // again, but we still report what it measured before.
+    int *measured = calloc(nchunks * nthreadcounts * nengines, sizeof(*measured));
+    if (!measured) die("calloc");
+#define MEASURED(c, t, e) measured[((c) * nthreadcounts + (t)) * nengines + (e)]
+
+    // The actual measurement. Within one round, we alternate between
+    // the engines, such that slow drifts of the system (e.g., thermal
+    // throttling) affect all of them alike.
+    for (int c = 0; c < nchunks; c++) {
+        chunk = chunks[c];
+        for (int t = 0; t < nthreadcounts; t++) {
+            nthreads = threads[t];
+            for (int i = 0; i < rounds; i++) {
+                for (int e = 0; e < nengines; e++) {
+                    if (engines[e].disabled || engines[e].unsupported
+                        || (t > 0 && !engines[e].parallel))
+                        continue;
+
+                    if (measure(fd_in, fd_out, engines[e].name, engines[e].copy,
+                                format == TEXT, &SAMPLES(c, t, e)[MEASURED(c, t, e)]) < 0)
+                        engines[e].unsupported = true;
+                    else
+                        MEASURED(c, t, e)++;
+                }
+            }
+        }
+    }
+
+    // Print the statistics for each copy algorithm, chunk size, and
+    // thread count.
+    if (format == CSV) {
+        printf("engine,chunk,threads,rounds,mean_mib_s,median_mib_s,p95_mib_s,"
+               "p99_mib_s,stddev_mib_s,user_s,sys_s,cpu_ns_per_byte");
+        for (int c = 0; c < PERF_COUNTERS; c++)
+            printf(",%s", perf_events[c].name);
+        printf("\n");
+    }
+    if (format == JSON)
+        printf("[\n");
+
+    bool first = true;
+    for (int c = 0; c < nchunks; c++) {
+        for (int t = 0; t < nthreadcounts; t++) {
+            for (int e = 0; e < nengines; e++) {
+                int n = MEASURED(c, t, e);
+                if (n == 0)
+                    continue;
 
-    // The actual measurement
-    double sendfile = 0, write = 0;
-    for (int i = 0; i < rounds; i++) {
-        sendfile += measure(fd_in, fd_out, "sendfile", copy_sendfile);
-        write    += measure(fd_in, fd_out, "read/write", copy_write);
+                struct summary s;
+                summarize(SAMPLES(c, t, e), n, &s);
+                report(format, first, engines[e].name, chunks[c],
+                       engines[e].parallel ? threads[t] : 1, n, &s);
+                first = false;
+            }
+        }
     }
 
-    // Print the average MiB/s for both copy algorithms
-    printf("sendfile: %.2f MiB/s, read/write: %.2f MiB/s\n",
-           sendfile/rounds/(1024*1024),
-           write/rounds/(1024*1024));
+    if (format == JSON)
+        printf("\n]\n");
 }
@@ -0,0 +1,342 @@
+/* Copy implementations that move the file through a socket.
+ *
+ * Files are usually not copied to other files, but served over the
+ * network. Therefore, we measure both directions with two kinds of
+ * local connections: a unix-domain socket pair and a loopback TCP
+ * connection.
+ *
+ *   file -> socket: sendfile, read/write, send(MSG_ZEROCOPY)
+ *   socket -> file: splice, read/write
+ *
+ * The other end of the connection is served by a helper thread: For
+ * file -> socket, it drains and discards the received data; for
+ * socket -> file, it feeds the input file into the socket with
+ * sendfile(). The helper's system calls are not counted, but its CPU
+ * time is part of getrusage(RUSAGE_SELF). */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+// Create a connected pair of stream sockets. sv[0] is our end, sv[1]
+// the end of the helper thread.
+static void connection_open(bool tcp, int sv[2], int *syscalls) {
+    if (!tcp) {
+        (*syscalls)++;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) die("socketpair");
+        return;
+    }
+
+    // For TCP, we listen on an ephemeral loopback port and connect to
+    // it ourselves.
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = 0,
+    };
+    socklen_t len = sizeof(addr);
+
+    (*syscalls) += 8;
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server < 0) die("socket");
+    if (bind(server, (struct sockaddr *) &addr, sizeof(addr)) < 0) die("bind");
+    if (listen(server, 1) < 0) die("listen");
+    if (getsockname(server, (struct sockaddr *) &addr, &len) < 0) die("getsockname");
+
+    sv[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (sv[0] < 0) die("socket");
+    if (connect(sv[0], (struct sockaddr *) &addr, sizeof(addr)) < 0) die("connect");
+    sv[1] = accept(server, NULL, NULL);
+    if (sv[1] < 0) die("accept");
+    close(server);
+}
+
+struct peer {
+    int sock;                   // the helper's end of the connection
+    int fd_in;                  // for feed(): the file to send
+    ssize_t bytes;              // bytes drained or fed
+};
+
+// Helper thread: read and discard everything until the other end
+// shuts the connection down.
+static void *peer_drain(void *arg) {
+    struct peer *p = arg;
+    char *buf = malloc(CHUNK_MAX);
+    if (!buf) die("malloc");
+
+    ssize_t n;
+    while ((n = read(p->sock, buf, CHUNK_MAX)) > 0)
+        p->bytes += n;
+    if (n < 0) die("read");
+
+    free(buf);
+    return NULL;
+}
+
+// Helper thread: send the whole input file and shut down the
+// connection for writing. We use explicit offsets, as the copy
+// implementation does not touch fd_in in this direction.
+static void *peer_feed(void *arg) {
+    struct peer *p = arg;
+    off_t off = 0;
+
+    ssize_t n;
+    while ((n = sendfile(p->sock, p->fd_in, &off, CHUNK_MAX)) > 0)
+        p->bytes += n;
+    if (n < 0) die("sendfile");
+
+    shutdown(p->sock, SHUT_WR);
+    return NULL;
+}
+
+static void peer_start(pthread_t *thread, struct peer *p, void *(*fn)(void *)) {
+    int err = pthread_create(thread, NULL, fn, p);
+    if (err) { errno = err; die("pthread_create"); }
+}
+
+// Wait for the helper thread and close both ends of the connection.
+static void peer_stop(pthread_t thread, int sv[2], int *syscalls) {
+    pthread_join(thread, NULL);
+    (*syscalls) += 2;
+    close(sv[0]);
+    close(sv[1]);
+}
+
+// Read all MSG_ZEROCOPY completion notifications that are queued on
+// the error queue of sock. Each notification covers a range of send()
+// calls, which are numbered from zero. Returns the number of
+// completed send() calls.
+static unsigned zerocopy_reap(int sock, bool *copied, int *syscalls) {
+    unsigned completed = 0;
+
+    for (;;) {
+        char control[128];
+        struct msghdr msg = {
+            .msg_control    = control,
+            .msg_controllen = sizeof(control),
+        };
+
+        (*syscalls)++;
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return completed;
+            die("recvmsg");
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP   && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            struct sock_extended_err *ee = (void *) CMSG_DATA(cm);
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0)
+                continue;
+
+            // [ee_info, ee_data] is the range of completed sends
+            completed += ee->ee_data - ee->ee_info + 1;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                *copied = true;
+        }
+    }
+}
+
+// file -> socket. mode selects the implementation.
+enum { SEND_SENDFILE, SEND_WRITE, SEND_ZEROCOPY };
+
+static ssize_t copy_to_socket(int fd_in, bool tcp, int mode, int *syscalls) {
+    ssize_t ret = 0;
+    *syscalls = 0;
+
+    int sv[2];
+    connection_open(tcp, sv, syscalls);
+
+    if (mode == SEND_ZEROCOPY) {
+        int one = 1;
+        (*syscalls)++;
+        if (setsockopt(sv[0], SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+            int err = errno;
+            close(sv[0]);
+            close(sv[1]);
+            errno = err;
+            return -1;
+        }
+    }
+
+    pthread_t thread;
+    struct peer peer = { .sock = sv[1] };
+    peer_start(&thread, &peer, peer_drain);
+
+    if (mode == SEND_SENDFILE) {
+        ssize_t bytes;
+        while ((bytes = ((*syscalls)++, sendfile(sv[0], fd_in, NULL, chunk))) > 0)
+            ret += bytes;
+        if (bytes < 0) die("sendfile");
+    } else if (mode == SEND_WRITE) {
+        ssize_t bytes;
+        while ((bytes = ((*syscalls)++, read(fd_in, buffer, chunk))) > 0) {
+            for (ssize_t acc = 0; acc < bytes; ) {
+                (*syscalls)++;
+                ssize_t n = write(sv[0], buffer + acc, bytes - acc);
+                if (n < 0) die("write");
+                acc += n;
+            }
+            ret += bytes;
+        }
+        if (bytes < 0) die("read");
+    } else {
+        // With MSG_ZEROCOPY, the kernel pins our pages instead of
+        // copying them into the socket buffer. We must not modify or
+        // unmap the pages before the kernel reports the completion on
+        // the socket's error queue. We send directly from a read-only
+        // mapping of the input file.
+        struct stat st;
+        (*syscalls)++;
+        if (fstat(fd_in, &st) < 0) die("fstat");
+
+        char *map = NULL;
+        if (st.st_size > 0) {
+            (*syscalls)++;
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd_in, 0);
+            if (map == MAP_FAILED) die("mmap");
+        }
+
+        unsigned sent = 0, completed = 0;
+        bool copied = false;
+        while (ret < st.st_size) {
+            size_t len = st.st_size - ret < (off_t) chunk ? (size_t) (st.st_size - ret) : chunk;
+
+            (*syscalls)++;
+            ssize_t n = send(sv[0], map + ret, len, MSG_ZEROCOPY);
+            if (n < 0) {
+                // The memory for pinned pages is limited
+                // (net.core.optmem_max). Wait for completions
+                // before we try again. If none are pending, waiting
+                // would not help, and we copy this chunk.
+                if (errno != ENOBUFS) die("send");
+                if (completed == sent) {
+                    (*syscalls)++;
+                    n = send(sv[0], map + ret, len, 0);
+                    if (n < 0) die("send");
+                    ret += n;
+                    continue;
+                }
+                struct pollfd pfd = { .fd = sv[0], .events = 0 };
+                (*syscalls)++;
+                if (poll(&pfd, 1, -1) < 0) die("poll");
+                completed += zerocopy_reap(sv[0], &copied, syscalls);
+                continue;
+            }
+
+            sent++;
+            ret += n;
+            completed += zerocopy_reap(sv[0], &copied, syscalls);
+        }
+
+        // Wait for the outstanding completions. They are signaled
+        // as POLLERR, which poll() reports without asking for it.
+        while (completed < sent) {
+            struct pollfd pfd = { .fd = sv[0], .events = 0 };
+            (*syscalls)++;
+            if (poll(&pfd, 1, -1) < 0) die("poll");
+            completed += zerocopy_reap(sv[0], &copied, syscalls);
+        }
+
+        static bool warned;
+        if (copied && !warned) {
+            fprintf(stderr, "zerocopy: the kernel fell back to copying "
+                    "(always the case on loopback)\n");
+            warned = true;
+        }
+
+        if (map) {
+            (*syscalls)++;
+            munmap(map, st.st_size);
+        }
+    }
+
+    // Signal the end of the stream and wait until the helper has
+    // received all bytes.
+    (*syscalls)++;
+    shutdown(sv[0], SHUT_WR);
+    peer_stop(thread, sv, syscalls);
+
+    if (peer.bytes != ret) {
+        fprintf(stderr, "sent %zd bytes, but received %zd\n", ret, peer.bytes);
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+// socket -> file. With use_splice, data moves socket -> pipe -> file
+// without passing through user space.
+static ssize_t copy_from_socket(int fd_in, int fd_out, bool tcp, bool use_splice,
+                                int *syscalls) {
+    ssize_t ret = 0;
+    *syscalls = 0;
+
+    int sv[2];
+    connection_open(tcp, sv, syscalls);
+
+    pthread_t thread;
+    struct peer peer = { .sock = sv[1], .fd_in = fd_in };
+    peer_start(&thread, &peer, peer_feed);
+
+    ssize_t bytes;
+    if (use_splice) {
+        int pipefd[2];
+        pipe_open(pipefd, syscalls);
+
+        while ((bytes = ((*syscalls)++,
+                         splice(sv[0], NULL, pipefd[1], NULL, chunk,
+                                SPLICE_F_MOVE))) > 0) {
+            pipe_drain(pipefd, fd_out, bytes, syscalls);
+            ret += bytes;
+        }
+        if (bytes < 0) die("splice");
+
+        pipe_close(pipefd, syscalls);
+    } else {
+        while ((bytes = ((*syscalls)++, read(sv[0], buffer, chunk))) > 0) {
+            for (ssize_t acc = 0; acc < bytes; ) {
+                (*syscalls)++;
+                ssize_t n = write(fd_out, buffer + acc, bytes - acc);
+                if (n < 0) die("write");
+                acc += n;
+            }
+            ret += bytes;
+        }
+        if (bytes < 0) die("read");
+    }
+
+    peer_stop(thread, sv, syscalls);
+    return ret;
+}
+
+// Wrappers with the common copy interface
+#define SOCKET_ENGINE_TO(name, tcp, mode)                               \
+    ssize_t copy_##name(int fd_in, int fd_out, int *syscalls) {         \
+        (void) fd_out;                                                  \
+        return copy_to_socket(fd_in, tcp, mode, syscalls);              \
+    }
+#define SOCKET_ENGINE_FROM(name, tcp, use_splice)                       \
+    ssize_t copy_##name(int fd_in, int fd_out, int *syscalls) {         \
+        return copy_from_socket(fd_in, fd_out, tcp, use_splice, syscalls); \
+    }
+
+SOCKET_ENGINE_TO(unix_sendfile, false, SEND_SENDFILE)
+SOCKET_ENGINE_TO(tcp_sendfile,  true,  SEND_SENDFILE)
+SOCKET_ENGINE_TO(unix_write,    false, SEND_WRITE)
+SOCKET_ENGINE_TO(tcp_write,     true,  SEND_WRITE)
+SOCKET_ENGINE_TO(tcp_zerocopy,  true,  SEND_ZEROCOPY)
+SOCKET_ENGINE_FROM(unix_splice, false, true)
+SOCKET_ENGINE_FROM(tcp_splice,  true,  true)
+SOCKET_ENGINE_FROM(unix_read,   false, false)
+SOCKET_ENGINE_FROM(tcp_read,    true,  false)
@@ -0,0 +1,126 @@
+/* A minimal io_uring binding without liburing.
+ *
+ * An io_uring instance consists of two rings that are shared between
+ * kernel and user space: We put submission queue entries (SQEs) into
+ * the submission ring, and the kernel posts completion queue entries
+ * (CQEs) into the completion ring. Both rings and the SQE array are
+ * mapped into our address space with mmap() on the io_uring fd.
+ *
+ * We use a single io_uring_enter() call to submit all queued SQEs and
+ * to wait for their completion. */
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+
+    // Submission ring
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_pending;        // queued, but not yet submitted
+
+    // Completion ring
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+};
+
+// Returns -1 and sets errno if the kernel does not support io_uring.
+int uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len    = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Since Linux 5.4, both rings live in a single mapping.
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_len > r->sq_ring_len)
+            r->sq_ring_len = r->cq_ring_len;
+        r->cq_ring_len = r->sq_ring_len;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) die("mmap");
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) die("mmap");
+    }
+
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) die("mmap");
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head  = (unsigned *) (sq + p.sq_off.head);
+    r->sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->cq_head  = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    r->sq_pending = 0;
+
+    return 0;
+}
+
+void uring_exit(struct uring *r) {
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_len);
+    munmap(r->sq_ring, r->sq_ring_len);
+    close(r->fd);
+}
+
+// Queue a read or write request. It is not submitted before the next
+// uring_enter().
+void uring_prep_rw(struct uring *r, int op, int fd, void *buf,
+                   unsigned len, off_t off, uint64_t user_data) {
+    unsigned tail = *r->sq_tail;
+    unsigned idx  = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = op;
+    sqe->fd        = fd;
+    sqe->addr      = (unsigned long) buf;
+    sqe->len       = len;
+    sqe->off       = off;
+    sqe->user_data = user_data;
+
+    r->sq_array[idx] = idx;
+    // The kernel must see the SQE before it sees the new tail.
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->sq_pending++;
+}
+
+// Submit all queued requests and wait for at least wait_nr completions.
+void uring_enter(struct uring *r, unsigned wait_nr) {
+    int ret = syscall(__NR_io_uring_enter, r->fd, r->sq_pending, wait_nr,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) die("io_uring_enter");
+    r->sq_pending -= ret;
+}
+
+// Pop one completion. Returns false if the completion ring is empty.
+bool uring_reap(struct uring *r, struct io_uring_cqe *cqe) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+
+    *cqe = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
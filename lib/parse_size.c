@@ -0,0 +1,55 @@
+/* Parse sizes from the environment, like "4096", "64K", "16M", or "1G".
+ *
+ * The suffixes are binary (K = 1024) and case insensitive. Unlike a
+ * bare strtoul(), parse_size() rejects everything that is not a size:
+ * an empty string, a sign, trailing garbage ("512MB"), and values that
+ * do not fit into a size_t.
+ *
+ * Example: if (parse_size(getenv("SIZE"), NULL, &size) < 0) ...
+ */
+#ifndef PARSE_SIZE_C
+#define PARSE_SIZE_C
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Parse the size at the beginning of s into *size. With end == NULL,
+   the size must be all of s. Otherwise, *end points behind the size and
+   its suffix, such that the caller can parse lists like "4K,1M".
+   Returns 0, or -1 with errno set to EINVAL or ERANGE. */
+static int parse_size(const char *s, char **end, size_t *size) {
+    if (!s || *s < '0' || *s > '9') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *p;
+    errno = 0;
+    unsigned long long ret = strtoull(s, &p, 10);
+    if (errno)
+        return -1;
+
+    unsigned shift = 0;
+    switch (*p) {
+    case 'G': case 'g': shift = 30; p++; break;
+    case 'M': case 'm': shift = 20; p++; break;
+    case 'K': case 'k': shift = 10; p++; break;
+    }
+
+    if (!end && *p != '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ret > (SIZE_MAX >> shift)) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    if (end)
+        *end = p;
+    *size = (size_t) ret << shift;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,40 @@
+/* System calls that do not touch errno.
+ *
+ * The syscall() wrapper of the C library (and every other wrapper)
+ * stores the error code of a failed system call in errno, which lives
+ * in the thread-local storage (TLS) of the calling thread. Threads that
+ * we create with a raw clone() and without CLONE_SETTLS have no TLS of
+ * their own: They share it with the thread that created them, and any
+ * errno update races with that thread.
+ *
+ * raw_syscall() enters the kernel directly and returns errors as
+ * -errno instead. It is only implemented for x86-64; elsewhere,
+ * HAVE_RAW_SYSCALL is not defined, and users must fall back to the
+ * C library (or refuse to build).
+ */
+#ifndef RAW_SYSCALL_C
+#define RAW_SYSCALL_C
+
+#include <sys/syscall.h>
+
+#if defined(__x86_64__)
+#define HAVE_RAW_SYSCALL 1
+
+static inline long raw_syscall(long nr, long a1, long a2, long a3,
+                               long a4, long a5, long a6) {
+    // The kernel takes the arguments in rdi, rsi, rdx, r10, r8, r9,
+    // and clobbers rcx and r11.
+    register long r10 asm("r10") = a4;
+    register long r8  asm("r8")  = a5;
+    register long r9  asm("r9")  = a6;
+    long ret;
+    asm volatile("syscall"
+                 : "=a" (ret)
+                 : "0" (nr), "D" (a1), "S" (a2), "d" (a3),
+                   "r" (r10), "r" (r8), "r" (r9)
+                 : "rcx", "r11", "memory");
+    return ret;
+}
+#endif
+
+#endif
@@ -0,0 +1,264 @@
+/* Memory-map instrumentation from /proc/self/smaps.
+ *
+ * For each mapping, the kernel reports in /proc/PID/smaps how much of
+ * it is resident (RSS), our proportional share of it (PSS: shared pages
+ * count 1/N for N sharers), how much is dirty, swapped out, anonymous,
+ * or backed by huge pages. /proc/PID/smaps_rollup has the same fields,
+ * summed up over all mappings, and is much cheaper to read.
+ *
+ * Instead of forking a shell for pmap(1), which copies our page tables
+ * and shows less, we parse these files ourselves:
+ *
+ *   smaps_read()   -- call a function for each mapping
+ *   smaps_find()   -- the mapping that contains an address
+ *   smaps_rollup() -- the totals
+ *   smaps_print()  -- a pmap-like table with totals
+ *   smaps_watch()  -- print the totals every interval from a thread
+ *
+ * All sizes are in KiB, as reported by the kernel.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct smaps_mapping {
+    unsigned long start, end;   // only for smaps_read()/smaps_find()
+    char perms[5];
+    char name[256];
+
+    unsigned long size, rss, pss, pss_anon, pss_file;
+    unsigned long shared_clean, shared_dirty, private_clean, private_dirty;
+    unsigned long anonymous, swap;
+    unsigned long anon_huge, shmem_pmd, file_pmd;
+    unsigned long shared_hugetlb, private_hugetlb;
+};
+
+static const struct {
+    char *key;
+    size_t offset;
+} smaps_fields[] = {
+#define SMAPS_FIELD(key, field) { key ":", offsetof(struct smaps_mapping, field) }
+    SMAPS_FIELD("Size",            size),
+    SMAPS_FIELD("Rss",             rss),
+    SMAPS_FIELD("Pss",             pss),
+    SMAPS_FIELD("Pss_Anon",        pss_anon),
+    SMAPS_FIELD("Pss_File",        pss_file),
+    SMAPS_FIELD("Shared_Clean",    shared_clean),
+    SMAPS_FIELD("Shared_Dirty",    shared_dirty),
+    SMAPS_FIELD("Private_Clean",   private_clean),
+    SMAPS_FIELD("Private_Dirty",   private_dirty),
+    SMAPS_FIELD("Anonymous",       anonymous),
+    SMAPS_FIELD("Swap",            swap),
+    SMAPS_FIELD("AnonHugePages",   anon_huge),
+    SMAPS_FIELD("ShmemPmdMapped",  shmem_pmd),
+    SMAPS_FIELD("FilePmdMapped",   file_pmd),
+    SMAPS_FIELD("Shared_Hugetlb",  shared_hugetlb),
+    SMAPS_FIELD("Private_Hugetlb", private_hugetlb),
+#undef SMAPS_FIELD
+};
+
+static unsigned long smaps_dirty(const struct smaps_mapping *m) {
+    return m->shared_dirty + m->private_dirty;
+}
+
+// Memory that is mapped with huge pages (THP or hugetlbfs)
+static unsigned long smaps_huge(const struct smaps_mapping *m) {
+    return m->anon_huge + m->shmem_pmd + m->file_pmd +
+        m->shared_hugetlb + m->private_hugetlb;
+}
+
+// Parse a "Key: value kB" line into m. Returns false for other lines.
+static bool smaps_parse_field(struct smaps_mapping *m, const char *line) {
+    for (size_t i = 0; i < sizeof(smaps_fields) / sizeof(*smaps_fields); i++) {
+        size_t len = strlen(smaps_fields[i].key);
+        if (strncmp(line, smaps_fields[i].key, len))
+            continue;
+        *(unsigned long *) ((char *) m + smaps_fields[i].offset) =
+            strtoul(line + len, NULL, 10);
+        return true;
+    }
+    return false;
+}
+
+// Parse a header line like "7f..-7f.. rw-p 00000000 fe:00 1234  /lib/foo.so"
+static bool smaps_parse_header(struct smaps_mapping *m, const char *line) {
+    int name = 0;
+    if (sscanf(line, "%lx-%lx %4s %*x %*x:%*x %*u %n",
+               &m->start, &m->end, m->perms, &name) < 3 || name == 0)
+        return false;
+
+    snprintf(m->name, sizeof(m->name), "%s", line + name);
+    m->name[strcspn(m->name, "\n")] = '\0';
+    return true;
+}
+
+// Call fn for each mapping of pid (0: ourselves), until it returns
+// non-zero. Returns fn's result, 0, or -1 if smaps cannot be read.
+int smaps_read(pid_t pid, int (*fn)(struct smaps_mapping *, void *), void *arg) {
+    char path[64], line[512];
+    if (pid)
+        snprintf(path, sizeof(path), "/proc/%d/smaps", pid);
+    else
+        snprintf(path, sizeof(path), "/proc/self/smaps");
+
+    FILE *f = fopen(path, "re");
+    if (!f)
+        return -1;
+
+    struct smaps_mapping m;
+    bool valid = false;
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        if (smaps_parse_field(&m, line))
+            continue;
+
+        struct smaps_mapping next;
+        memset(&next, 0, sizeof(next));
+        if (!smaps_parse_header(&next, line))
+            continue;           // VmFlags, THPeligible, ...
+
+        if (valid)
+            ret = fn(&m, arg);
+        m = next;
+        valid = true;
+    }
+    if (ret == 0 && valid)
+        ret = fn(&m, arg);
+
+    fclose(f);
+    return ret;
+}
+
+struct smaps_find_arg {
+    unsigned long addr;
+    struct smaps_mapping *out;
+};
+
+static int smaps_find_one(struct smaps_mapping *m, void *arg) {
+    struct smaps_find_arg *a = arg;
+    if (a->addr < m->start || a->addr >= m->end)
+        return 0;
+    *a->out = *m;
+    return 1;
+}
+
+// Find our mapping that contains addr. Returns 0 on success.
+int smaps_find(void *addr, struct smaps_mapping *out) {
+    struct smaps_find_arg a = { (unsigned long) addr, out };
+    return smaps_read(0, smaps_find_one, &a) == 1 ? 0 : -1;
+}
+
+// Read the totals over all mappings of pid (0: ourselves)
+int smaps_rollup(pid_t pid, struct smaps_mapping *total) {
+    char path[64], line[512];
+    if (pid)
+        snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+    else
+        snprintf(path, sizeof(path), "/proc/self/smaps_rollup");
+
+    FILE *f = fopen(path, "re");
+    if (!f)
+        return -1;
+
+    memset(total, 0, sizeof(*total));
+    snprintf(total->name, sizeof(total->name), "total");
+    while (fgets(line, sizeof(line), f))
+        smaps_parse_field(total, line);
+
+    fclose(f);
+    return 0;
+}
+
+static int smaps_print_one(struct smaps_mapping *m, void *arg) {
+    FILE *out = arg;
+    fprintf(out, "%016lx %8lu %8lu %8lu %8lu %8lu %8lu %8lu %s %s\n",
+            m->start, m->size, m->rss, m->pss, smaps_dirty(m), m->swap,
+            m->anonymous, smaps_huge(m), m->perms,
+            m->name[0] ? m->name : "[ anon ]");
+    return 0;
+}
+
+// Print our memory map, like pmap -x, but with PSS, swap, and huge pages
+int smaps_print(FILE *out) {
+    fprintf(out, "%-16s %8s %8s %8s %8s %8s %8s %8s %-4s %s\n", "Address", "Kbytes",
+            "RSS", "PSS", "Dirty", "Swap", "Anon", "Huge", "Mode", "Mapping");
+    if (smaps_read(0, smaps_print_one, out) < 0)
+        return -1;
+
+    struct smaps_mapping total;
+    if (smaps_rollup(0, &total) < 0)
+        return -1;
+    fprintf(out, "%-16s %8s %8lu %8lu %8lu %8lu %8lu %8lu\n", "total kB", "",
+            total.rss, total.pss, smaps_dirty(&total), total.swap,
+            total.anonymous, smaps_huge(&total));
+    return 0;
+}
+
+/* Periodic snapshots: A thread prints one line with our totals every
+ * interval. It blocks all signals, such that they are still delivered
+ * to the threads of the program. */
+struct smaps_watch {
+    pthread_t thread;
+    FILE *out;
+    unsigned interval_ms;
+    struct timespec start;
+};
+
+static void *smaps_watch_thread(void *arg) {
+    struct smaps_watch *w = arg;
+
+    // We may only be cancelled while we sleep, not while we hold a lock
+    // in stdio.
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    for (;;) {
+        struct smaps_mapping t;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (smaps_rollup(0, &t) == 0) {
+            fprintf(w->out, "smaps: %8.3f s  rss %lu  pss %lu (anon %lu, file %lu)  "
+                    "dirty %lu  swap %lu  huge %lu kB\n",
+                    (now.tv_sec - w->start.tv_sec) + (now.tv_nsec - w->start.tv_nsec) / 1e9,
+                    t.rss, t.pss, t.pss_anon, t.pss_file, smaps_dirty(&t), t.swap,
+                    smaps_huge(&t));
+            fflush(w->out);
+        }
+
+        struct timespec ts = {
+            .tv_sec  = w->interval_ms / 1000,
+            .tv_nsec = (w->interval_ms % 1000) * 1000000L,
+        };
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        nanosleep(&ts, NULL);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    }
+    return NULL;
+}
+
+int smaps_watch(struct smaps_watch *w, FILE *out, unsigned interval_ms) {
+    w->out = out;
+    w->interval_ms = interval_ms ? interval_ms : 1000;
+    clock_gettime(CLOCK_MONOTONIC, &w->start);
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&w->thread, NULL, smaps_watch_thread, w);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void smaps_unwatch(struct smaps_watch *w) {
+    pthread_cancel(w->thread);  // nanosleep() is a cancellation point
+    pthread_join(w->thread, NULL);
+}
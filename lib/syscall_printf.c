@@ -0,0 +1,233 @@
+/* An async-signal-safe printf() for signal handlers and raw clone()
+ * children.
+ *
+ * printf() is neither async-signal-safe (it takes the stdio lock and
+ * may call malloc()), nor does it work in threads without their own
+ * thread-local storage. syscall_printf() avoids both problems:
+ *
+ *   - All state lives on the caller's stack. Thereby, each thread (and
+ *     each nested signal handler) formats into its own buffer, and we
+ *     need no locks at all.
+ *   - We do not copy the format string or string arguments. Instead,
+ *     we collect pointers to all pieces of the message in an iovec
+ *     array. Only numbers are formatted into a small scratch buffer.
+ *   - The whole message is written with a single writev() system
+ *     call. For pipes, writes of up to PIPE_BUF bytes are atomic, so
+ *     lines from different threads or processes do not tear.
+ *   - Where we have raw_syscall(), we do not touch errno at all, as
+ *     threads without TLS share it with another thread. Elsewhere, we
+ *     save and restore errno, which is enough for signal handlers.
+ *
+ * Supported conversions: %s, %c, %d, %u, %x, %p, and %%, with the
+ * length modifiers l, ll, and z, and an optional zero-padded width
+ * (e.g., %016lx).
+ *
+ * Example: syscall_printf(1, "SIGSEGV at 0x%lx (%s)\n", addr, "write");
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "raw_syscall.c"
+
+#define SYSCALL_PRINTF_IOV     32
+#define SYSCALL_PRINTF_SCRATCH 256
+
+struct syscall_printf_state {
+    int fd;
+    int ret;                    // bytes written so far, or -1
+    struct iovec iov[SYSCALL_PRINTF_IOV];
+    int niov;
+    char scratch[SYSCALL_PRINTF_SCRATCH];
+    size_t used;                // bytes of scratch in use
+};
+
+// Write all collected pieces with one writev(). We only end up here
+// more than once per call if a message has more than
+// SYSCALL_PRINTF_IOV pieces or more than SYSCALL_PRINTF_SCRATCH bytes
+// of formatted numbers.
+static void syscall_printf_flush(struct syscall_printf_state *s) {
+    struct iovec *iov = s->iov;
+    int niov = s->niov;
+
+    while (niov > 0 && s->ret >= 0) {
+#ifdef HAVE_RAW_SYSCALL
+        ssize_t n = raw_syscall(SYS_writev, s->fd, (long) iov, niov, 0, 0, 0);
+        int err = n < 0 ? (int) -n : 0;
+#else
+        ssize_t n = writev(s->fd, iov, niov);
+        int err = n < 0 ? errno : 0;
+#endif
+        if (n < 0) {
+            if (err == EINTR)
+                continue;
+            s->ret = -1;
+            break;
+        }
+        s->ret += n;
+
+        // Skip the pieces that were written completely
+        while (niov > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    s->niov = 0;
+    s->used = 0;
+}
+
+static void syscall_printf_piece(struct syscall_printf_state *s,
+                                 const char *p, size_t len) {
+    if (len == 0)
+        return;
+    if (s->niov == SYSCALL_PRINTF_IOV)
+        syscall_printf_flush(s);
+
+    s->iov[s->niov].iov_base = (void *) p;
+    s->iov[s->niov].iov_len  = len;
+    s->niov++;
+}
+
+// Reserve len bytes of scratch for the next piece. We flush first if
+// either the scratch or the iov array is full, as a flush reuses the
+// scratch from offset 0.
+static char *syscall_printf_reserve(struct syscall_printf_state *s, size_t len) {
+    if (s->used + len > sizeof(s->scratch) || s->niov == SYSCALL_PRINTF_IOV)
+        syscall_printf_flush(s);
+
+    char *dst = &s->scratch[s->used];
+    s->used += len;
+    return dst;
+}
+
+// Format an unsigned number into the scratch buffer
+static void syscall_printf_number(struct syscall_printf_state *s,
+                                  uintmax_t value, bool negative,
+                                  unsigned base, int width) {
+    char digits[sizeof(value) * 8 + 1];
+    char *p = &digits[sizeof(digits)];
+    int len = 0;
+
+    do {
+        *(--p) = "0123456789abcdef"[value % base];
+        value /= base;
+        len++;
+    } while (value != 0);
+
+    while (len < width && len < (int) sizeof(digits) - 1) {
+        *(--p) = '0';
+        len++;
+    }
+    if (negative) {
+        *(--p) = '-';
+        len++;
+    }
+
+    char *dst = syscall_printf_reserve(s, len);
+    memcpy(dst, p, len);
+    syscall_printf_piece(s, dst, len);
+}
+
+int syscall_vprintf(int fd, const char *fmt, va_list ap) {
+    struct syscall_printf_state s = { .fd = fd };
+#ifndef HAVE_RAW_SYSCALL
+    int saved_errno = errno;    // signal handlers must preserve errno
+#endif
+
+    while (*fmt) {
+        const char *start = fmt;
+        while (*fmt && *fmt != '%')
+            fmt++;
+        syscall_printf_piece(&s, start, fmt - start);
+        if (!*fmt)
+            break;
+
+        const char *spec = fmt;
+        fmt++;                  // skip '%'
+        int width = 0, longs = 0;
+        bool size = false;
+        while (*fmt >= '0' && *fmt <= '9')
+            width = width * 10 + (*fmt++ - '0');
+        for (; *fmt == 'l'; fmt++)
+            longs++;
+        if (*fmt == 'z') {
+            size = true;
+            fmt++;
+        }
+
+        uintmax_t value;
+        switch (*fmt) {
+        case 'd': {
+            intmax_t v = size ? (intmax_t) va_arg(ap, ssize_t)
+                : longs >= 2  ? va_arg(ap, long long)
+                : longs == 1  ? va_arg(ap, long)
+                : va_arg(ap, int);
+            // Negate in unsigned arithmetic, which is also correct
+            // for the most negative value.
+            value = v < 0 ? -(uintmax_t) v : (uintmax_t) v;
+            syscall_printf_number(&s, value, v < 0, 10, width);
+            break;
+        }
+        case 'u':
+        case 'x':
+            value = size      ? va_arg(ap, size_t)
+                : longs >= 2  ? va_arg(ap, unsigned long long)
+                : longs == 1  ? va_arg(ap, unsigned long)
+                : va_arg(ap, unsigned);
+            syscall_printf_number(&s, value, false, *fmt == 'x' ? 16 : 10, width);
+            break;
+        case 'p':
+            syscall_printf_piece(&s, "0x", 2);
+            syscall_printf_number(&s, (uintptr_t) va_arg(ap, void *), false, 16, width);
+            break;
+        case 's': {
+            const char *str = va_arg(ap, const char *);
+            if (!str)
+                str = "(null)";
+            syscall_printf_piece(&s, str, strlen(str));
+            break;
+        }
+        case 'c': {
+            char *dst = syscall_printf_reserve(&s, 1);
+            *dst = (char) va_arg(ap, int);
+            syscall_printf_piece(&s, dst, 1);
+            break;
+        }
+        case '%':
+            syscall_printf_piece(&s, "%", 1);
+            break;
+        default:                // unknown conversion: print it as is
+            if (!*fmt) {
+                syscall_printf_piece(&s, spec, fmt - spec);
+                continue;
+            }
+            syscall_printf_piece(&s, spec, fmt + 1 - spec);
+            break;
+        }
+        fmt++;
+    }
+
+    syscall_printf_flush(&s);
+#ifndef HAVE_RAW_SYSCALL
+    errno = saved_errno;
+#endif
+    return s.ret;
+}
+
+int syscall_printf(int fd, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = syscall_vprintf(fd, fmt, ap);
+    va_end(ap);
+    return ret;
+}